@@ -0,0 +1,465 @@
+#include "lab4fs.h"
+
+struct lab4fs_group_desc *lab4fs_get_group_desc(struct super_block *sb,
+        unsigned int group, struct buffer_head **bh)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    unsigned long block, offset;
+
+    if (group >= sbi->s_groups_count || sbi->s_group_desc == NULL) {
+        LAB4ERROR("no descriptor for group %u\n", group);
+        return NULL;
+    }
+    block = group / sbi->s_desc_per_block;
+    offset = group % sbi->s_desc_per_block;
+    if (bh)
+        *bh = sbi->s_group_desc[block];
+    return (struct lab4fs_group_desc *)sbi->s_group_desc[block]->b_data +
+        offset;
+}
+
+/*
+ * Block reservation windows.
+ *
+ * A regular file being written owns a window: a range of the data
+ * bitmap which other files do not use when they open a window of their
+ * own. The file's blocks come from its window as long as it has free
+ * blocks, so several files appended concurrently each get their own
+ * contiguous runs instead of interleaving block by block.
+ *
+ * Windows only live in memory. They are kept in an rbtree sorted by
+ * start, protected by sbi->s_rsv_window_lock, and dropped when the
+ * file is closed for writing or the inode is evicted. Window bounds
+ * are data bitmap bit numbers, both inclusive.
+ */
+
+static struct lab4fs_reserve_window *
+rsv_search(struct rb_root *root, __u32 bit)
+{
+    struct rb_node *n = root->rb_node;
+    struct lab4fs_reserve_window *rsv;
+
+    if (!n)
+        return NULL;
+    do {
+        rsv = rb_entry(n, struct lab4fs_reserve_window, rsv_node);
+        if (bit < rsv->rsv_start)
+            n = n->rb_left;
+        else if (bit > rsv->rsv_end)
+            n = n->rb_right;
+        else
+            return rsv;
+    } while (n);
+
+    /* No window covers bit; return the last one starting before it */
+    if (rsv->rsv_start > bit) {
+        n = rb_prev(&rsv->rsv_node);
+        rsv = n ? rb_entry(n, struct lab4fs_reserve_window, rsv_node) : NULL;
+    }
+    return rsv;
+}
+
+static void rsv_insert(struct rb_root *root, struct lab4fs_reserve_window *rsv)
+{
+    struct rb_node **p = &root->rb_node;
+    struct rb_node *parent = NULL;
+    struct lab4fs_reserve_window *this;
+
+    while (*p) {
+        parent = *p;
+        this = rb_entry(parent, struct lab4fs_reserve_window, rsv_node);
+        if (rsv->rsv_start < this->rsv_start)
+            p = &(*p)->rb_left;
+        else
+            p = &(*p)->rb_right;
+    }
+    rb_link_node(&rsv->rsv_node, parent, p);
+    rb_insert_color(&rsv->rsv_node, root);
+}
+
+static inline int rsv_is_empty(struct lab4fs_reserve_window *rsv)
+{
+    return rsv->rsv_end == LAB4FS_RSV_NONE;
+}
+
+/* Called with s_rsv_window_lock held */
+static void rsv_window_remove(struct lab4fs_sb_info *sbi,
+        struct lab4fs_reserve_window *rsv)
+{
+    rb_erase(&rsv->rsv_node, &sbi->s_rsv_window_root);
+    rsv->rsv_start = LAB4FS_RSV_NONE;
+    rsv->rsv_end = LAB4FS_RSV_NONE;
+}
+
+/*
+ * Find room for a window of rsv->rsv_goal_size bits starting at the
+ * first free bit at or after goal that no other window covers, unless
+ * rsv already has one.  Gives up after a few collisions; the caller then
+ * allocates without one.  On success the window is returned in *start
+ * and *end.
+ *
+ * The bitmap search may have to read a bitmap block, so it is done
+ * without s_rsv_window_lock, and the bit found is checked against the
+ * other windows once the lock is taken.
+ */
+static int rsv_window_find(struct lab4fs_sb_info *sbi,
+        struct lab4fs_reserve_window *rsv, __u32 goal,
+        __u32 *start, __u32 *end)
+{
+    struct lab4fs_bitmap *bitmap = &sbi->s_data_bitmap;
+    struct lab4fs_reserve_window *prev;
+    struct rb_node *next;
+    __u32 first, last;
+    int tries;
+
+    for (tries = 0; tries < 16; tries++) {
+        spin_lock(&sbi->s_rsv_window_lock);
+        if (!rsv_is_empty(rsv))
+            goto found;
+        spin_unlock(&sbi->s_rsv_window_lock);
+
+        first = bitmap_find_next_zero_bit(bitmap, goal, 0);
+        if (first >= bitmap->nr_valid_bits)
+            return -1;
+
+        spin_lock(&sbi->s_rsv_window_lock);
+        if (!rsv_is_empty(rsv))
+            goto found;
+        prev = rsv_search(&sbi->s_rsv_window_root, first);
+        if (prev && first <= prev->rsv_end) {
+            goal = prev->rsv_end + 1;
+            spin_unlock(&sbi->s_rsv_window_lock);
+            if (goal >= bitmap->nr_valid_bits)
+                return -1;
+            continue;
+        }
+
+        last = first + rsv->rsv_goal_size - 1;
+        if (last >= bitmap->nr_valid_bits)
+            last = bitmap->nr_valid_bits - 1;
+        /* Do not run into the window that follows */
+        next = prev ? rb_next(&prev->rsv_node)
+            : rb_first(&sbi->s_rsv_window_root);
+        if (next) {
+            struct lab4fs_reserve_window *n;
+            n = rb_entry(next, struct lab4fs_reserve_window, rsv_node);
+            if (n->rsv_start <= last)
+                last = n->rsv_start - 1;
+        }
+
+        rsv->rsv_start = first;
+        rsv->rsv_end = last;
+        rsv_insert(&sbi->s_rsv_window_root, rsv);
+        goto found;
+    }
+    return -1;
+
+found:
+    *start = rsv->rsv_start;
+    *end = rsv->rsv_end;
+    spin_unlock(&sbi->s_rsv_window_lock);
+    return 0;
+}
+
+/*
+ * Claim up to max data bitmap bits for inode from its window, opening
+ * or moving the window as needed.  Return how many were claimed, 0
+ * when no window could be used.
+ */
+static int lab4fs_alloc_from_window(struct inode *inode, __u32 goal,
+        int max, __u32 *found)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
+    struct lab4fs_reserve_window *rsv = &LAB4FS_I(inode)->i_rsv_window;
+    struct lab4fs_bitmap *bitmap = &sbi->s_data_bitmap;
+    __u32 start, end;
+    int tries, got;
+
+    for (tries = 0; tries < 2; tries++) {
+        if (rsv_window_find(sbi, rsv, goal, &start, &end) < 0)
+            break;
+
+        if (goal > start && goal <= end)
+            start = goal;
+        got = bitmap_claim_zero_run(bitmap, start, end + 1, max, found);
+        if (got)
+            return got;
+
+        /*
+         * The window is used up. The file keeps streaming, so give it
+         * a bigger one right behind the old one.
+         */
+        spin_lock(&sbi->s_rsv_window_lock);
+        if (!rsv_is_empty(rsv))
+            rsv_window_remove(sbi, rsv);
+        if (rsv->rsv_goal_size < LAB4FS_MAX_RSV_BLOCKS)
+            rsv->rsv_goal_size <<= 1;
+        spin_unlock(&sbi->s_rsv_window_lock);
+        goal = end + 1;
+        if (goal >= bitmap->nr_valid_bits)
+            goal = 0;
+    }
+    return 0;
+}
+
+void lab4fs_discard_reservation(struct inode *inode)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
+    struct lab4fs_reserve_window *rsv = &LAB4FS_I(inode)->i_rsv_window;
+
+    if (rsv_is_empty(rsv))
+        return;
+    spin_lock(&sbi->s_rsv_window_lock);
+    if (!rsv_is_empty(rsv))
+        rsv_window_remove(sbi, rsv);
+    rsv->rsv_goal_size = LAB4FS_DEFAULT_RSV_BLOCKS;
+    spin_unlock(&sbi->s_rsv_window_lock);
+}
+
+/*
+ * Allocate up to *count physically contiguous blocks, starting as close
+ * to perfered as possible, with one bitmap lock round-trip.  Return the
+ * first block and store in *count how many were really allocated.
+ */
+__u32 lab4fs_alloc_blocks(struct inode *inode, __u32 perfered,
+        unsigned long *count, long *err)
+{
+	struct super_block *sb = inode->i_sb;
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_bitmap *bitmap = &sbi->s_data_bitmap;
+    __u32 start;
+    __u32 found;
+    int got;
+
+    if (perfered < sbi->s_data_blocks || perfered >= sbi->s_blocks_count)
+        perfered = sbi->s_data_blocks;
+    start = perfered - sbi->s_data_blocks;
+
+    /* Blocks promised to delayed writes are not ours to take */
+    if (!lab4fs_has_free_blocks(sbi, *count)) {
+        *count = 1;
+        if (!lab4fs_has_free_blocks(sbi, 1))
+            goto no_space;
+    }
+
+    if (S_ISREG(inode->i_mode)) {
+        got = lab4fs_alloc_from_window(inode, start, *count, &found);
+        if (got)
+            goto found_free;
+    }
+
+    got = bitmap_claim_zero_run(bitmap, start, bitmap->nr_valid_bits,
+            *count, &found);
+    if (!got && start)
+        got = bitmap_claim_zero_run(bitmap, 0, bitmap->nr_valid_bits,
+                *count, &found);
+    if (!got)
+        goto no_space;
+
+found_free:
+    found += sbi->s_data_blocks;
+    if (found + got > sbi->s_blocks_count)
+        goto io_err;
+    percpu_counter_mod(&sbi->s_free_data_blocks_counter, -got);
+	sb->s_dirt = 1;
+
+    *count = got;
+    return found;
+io_err:
+    *err = -EIO;
+    return 0;
+no_space:
+    *err = -ENOSPC;
+    return 0;
+}
+
+__u32 lab4fs_alloc_data_block(struct inode *inode, __u32 perfered, long *err)
+{
+    unsigned long count = 1;
+    return lab4fs_alloc_blocks(inode, perfered, &count, err);
+}
+
+/* Clear a run in the data bitmap, return how many blocks were in use */
+static int lab4fs_clear_blocks(struct super_block *sb, __u32 block,
+        unsigned long count)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+
+    if (block < sbi->s_data_blocks || block + count > sbi->s_blocks_count ||
+            block + count < block) {
+        LAB4ERROR("freeing blocks not in data area - block=%u, count=%lu\n",
+                block, count);
+        return 0;
+    }
+    return bitmap_clear_run(&sbi->s_data_bitmap, block - sbi->s_data_blocks,
+            count);
+}
+
+/* Give count blocks starting at block back to the free pool */
+void lab4fs_free_blocks(struct inode *inode, __u32 block, unsigned long count)
+{
+	struct super_block *sb = inode->i_sb;
+    int freed;
+
+    freed = lab4fs_clear_blocks(sb, block, count);
+    percpu_counter_mod(&LAB4FS_SB(sb)->s_free_data_blocks_counter, freed);
+	sb->s_dirt = 1;
+}
+
+/*
+ * Freeing many blocks, as truncate does.  Blocks handed to
+ * lab4fs_free_batch_add are gathered into a run while they follow or
+ * precede it, and each run is cleared from the bitmap at once; the free
+ * counter is only updated by lab4fs_free_batch_end.
+ */
+void lab4fs_free_batch_init(struct lab4fs_free_batch *fb, struct inode *inode)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->inode = inode;
+}
+
+static void lab4fs_free_batch_flush(struct lab4fs_free_batch *fb)
+{
+    if (fb->count)
+        fb->freed += lab4fs_clear_blocks(fb->inode->i_sb, fb->block,
+                fb->count);
+    fb->count = 0;
+}
+
+void lab4fs_free_batch_add(struct lab4fs_free_batch *fb, __u32 block,
+        unsigned long count)
+{
+    fb->nr += count;
+    if (fb->count && block == fb->block + fb->count) {
+        fb->count += count;
+        return;
+    }
+    if (fb->count && block + count == fb->block) {
+        fb->block = block;
+        fb->count += count;
+        return;
+    }
+    lab4fs_free_batch_flush(fb);
+    fb->block = block;
+    fb->count = count;
+}
+
+void lab4fs_free_batch_end(struct lab4fs_free_batch *fb)
+{
+	struct super_block *sb = fb->inode->i_sb;
+
+    lab4fs_free_batch_flush(fb);
+    if (!fb->freed)
+        return;
+    percpu_counter_mod(&LAB4FS_SB(sb)->s_free_data_blocks_counter, fb->freed);
+	sb->s_dirt = 1;
+    fb->freed = 0;
+}
+
+/*
+ * Take the next block of the page preallocation if it is the one we
+ * want anyway.  Return 0 if there is none to use.
+ */
+__u32 lab4fs_use_prealloc(struct inode *inode, __u32 goal)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __u32 block = 0;
+    int recharge = 0;
+
+    write_lock(&ei->rwlock);
+    if (ei->i_prealloc_count && ei->i_prealloc_block == goal) {
+        block = ei->i_prealloc_block++;
+        ei->i_prealloc_count--;
+        /* Fewer blocks left than delayed ones counted on them */
+        if (ei->i_prealloc_delayed > ei->i_prealloc_count) {
+            ei->i_prealloc_delayed--;
+            recharge = 1;
+        }
+    }
+    write_unlock(&ei->rwlock);
+    if (recharge)
+        percpu_counter_inc(&LAB4FS_SB(inode->i_sb)->s_delayed_blocks_counter);
+    return block;
+}
+
+/*
+ * Blocks allocated for the rest of a page ahead of time, see
+ * lab4fs_alloc_branch.  Hand back whatever was not used.
+ */
+void lab4fs_discard_prealloc(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __u32 block, recharge;
+    unsigned long count;
+
+    write_lock(&ei->rwlock);
+    block = ei->i_prealloc_block;
+    count = ei->i_prealloc_count;
+    recharge = ei->i_prealloc_delayed;
+    ei->i_prealloc_count = 0;
+    ei->i_prealloc_delayed = 0;
+    write_unlock(&ei->rwlock);
+    /* The delayed blocks these stood in for are owed again */
+    if (recharge)
+        percpu_counter_mod(&LAB4FS_SB(inode->i_sb)->s_delayed_blocks_counter,
+                recharge);
+    if (count)
+        lab4fs_free_blocks(inode, block, count);
+}
+
+/*
+ * Delayed allocation.
+ *
+ * A buffered write only reserves its block: the free count is charged
+ * through s_delayed_blocks_counter, the bitmap is left alone, and the
+ * buffer is mapped to LAB4FS_DELAYED_BLOCK.  The real blocks are chosen
+ * at writeback, once the whole dirty range is known.  meta is how many
+ * indirect blocks the caller expects the block to need as well.
+ */
+int lab4fs_reserve_delayed(struct inode *inode, int meta)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    write_lock(&ei->rwlock);
+    if (!lab4fs_has_free_blocks(sbi, 1 + meta)) {
+        write_unlock(&ei->rwlock);
+        return -ENOSPC;
+    }
+    ei->i_delayed_blocks++;
+    ei->i_delayed_meta += meta;
+    percpu_counter_mod(&sbi->s_delayed_blocks_counter, 1 + meta);
+    write_unlock(&ei->rwlock);
+    return 0;
+}
+
+/*
+ * Drop nr data block and up to meta indirect block reservations of
+ * inode, because the blocks are about to be allocated or will never be
+ * written.  Nothing delayed anymore means no indirect block is needed.
+ */
+void lab4fs_release_delayed(struct inode *inode, int nr, int meta)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    write_lock(&ei->rwlock);
+    if (nr > ei->i_delayed_blocks) {
+        LAB4ERROR("releasing %d delayed blocks of inode %lu, only %u held\n",
+                nr, inode->i_ino, ei->i_delayed_blocks);
+        nr = ei->i_delayed_blocks;
+    }
+    ei->i_delayed_blocks -= nr;
+    /* Preallocated blocks already paid for the ones that go away */
+    if (ei->i_prealloc_delayed > ei->i_delayed_blocks) {
+        nr -= ei->i_prealloc_delayed - ei->i_delayed_blocks;
+        ei->i_prealloc_delayed = ei->i_delayed_blocks;
+    }
+    if (meta > ei->i_delayed_meta || !ei->i_delayed_blocks)
+        meta = ei->i_delayed_meta;
+    ei->i_delayed_meta -= meta;
+    nr += meta;
+    write_unlock(&ei->rwlock);
+    if (nr)
+        percpu_counter_mod(&sbi->s_delayed_blocks_counter, -nr);
+}
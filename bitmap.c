@@ -2,177 +2,443 @@
 
 #define log2(n) ffz(~(n))
 
+/*
+ * Every bitmap block has its own spinlock, so allocations and frees
+ * landing in different bitmap blocks never contend with each other.
+ * Only the bits inside one block are serialized.
+ *
+ * Bitmap blocks are read on first use rather than at mount, and at most
+ * LAB4FS_BITMAP_MAX_CACHED of them stay pinned; the least recently used
+ * one is let go when another is read in.  Once released the buffer is an
+ * ordinary buffer cache page the VM can write back and reclaim.  Users
+ * hold a reference to the buffer while they work on it, so dropping it
+ * from the cache never pulls it out from under them.
+ */
+
+static inline struct lab4fs_bitmap_block *
+bitmap_locate(struct lab4fs_bitmap *bitmap, int nr, int *n, __u32 *offset)
+{
+    *n = nr >> bitmap->log_nr_bits_per_block;
+    *offset = nr & (bitmap->nr_bits_per_block - 1);
+    return &bitmap->blocks[*n];
+}
+
+/* Number of bits of block n which are really backed by the device */
+static inline __u32 bitmap_block_limit(struct lab4fs_bitmap *bitmap, int n)
+{
+    __u32 base = n << bitmap->log_nr_bits_per_block;
+    if (bitmap->nr_valid_bits - base < bitmap->nr_bits_per_block)
+        return bitmap->nr_valid_bits - base;
+    return bitmap->nr_bits_per_block;
+}
+
+/* Called with the lock of block n held */
+static inline void bitmap_account(struct lab4fs_bitmap *bitmap, int n,
+        int delta)
+{
+    bitmap->blocks[n].nr_free += delta;
+    atomic_add(delta, &bitmap->summary[n >> LAB4FS_BITMAP_SUMMARY_SHIFT]);
+}
+
+/*
+ * Return the buffer of bitmap block n with a reference held, reading it
+ * in if it is not cached.  The caller drops the reference with brelse.
+ */
+static struct buffer_head *bitmap_get_block(struct lab4fs_bitmap *bitmap,
+        int n)
+{
+    struct lab4fs_bitmap_block *blk = &bitmap->blocks[n];
+    struct lab4fs_bitmap_block *victim;
+    struct buffer_head *bh, *old = NULL;
+    __u32 limit;
+    int nr_free;
+
+    spin_lock(&bitmap->lru_lock);
+    if ((bh = blk->bh) != NULL) {
+        get_bh(bh);
+        list_move_tail(&blk->lru, &bitmap->lru);
+        spin_unlock(&bitmap->lru_lock);
+        return bh;
+    }
+    spin_unlock(&bitmap->lru_lock);
+
+    bh = sb_bread(bitmap->sb, blk->blocknr);
+    if (!bh) {
+        LAB4ERROR("Cannot load bitmap at block %u\n", blk->blocknr);
+        return NULL;
+    }
+
+    spin_lock(&bitmap->lru_lock);
+    if (blk->bh) {
+        /* Somebody else read it in meanwhile */
+        old = bh;
+        bh = blk->bh;
+        get_bh(bh);
+        list_move_tail(&blk->lru, &bitmap->lru);
+        spin_unlock(&bitmap->lru_lock);
+        brelse(old);
+        return bh;
+    }
+    if (!blk->counted) {
+        limit = bitmap_block_limit(bitmap, n);
+        nr_free = limit - bitmap_weight((unsigned long *)bh->b_data, limit);
+        spin_lock(&blk->lock);
+        bitmap_account(bitmap, n, nr_free - blk->nr_free);
+        blk->counted = 1;
+        spin_unlock(&blk->lock);
+    }
+    /* One reference for the cache, one for the caller */
+    get_bh(bh);
+    blk->bh = bh;
+    list_add_tail(&blk->lru, &bitmap->lru);
+    if (++bitmap->nr_cached > LAB4FS_BITMAP_MAX_CACHED) {
+        victim = list_entry(bitmap->lru.next, struct lab4fs_bitmap_block,
+                lru);
+        list_del_init(&victim->lru);
+        old = victim->bh;
+        victim->bh = NULL;
+        bitmap->nr_cached--;
+    }
+    spin_unlock(&bitmap->lru_lock);
+    if (old)
+        brelse(old);
+    return bh;
+}
+
+/*
+ * Set up a bitmap of nr_valid_bits bits, bits_per_block (a power of 2,
+ * at most a block's worth) in each block, the blocks being found by
+ * locate.  Nothing is read here.  The state kept for every bitmap block
+ * grows with the device, past what kmalloc gives on big ones, so it is
+ * vmalloc'ed.
+ */
 int bitmap_setup(struct lab4fs_bitmap *bitmap, struct super_block *sb,
-        __u32 start_block)
+        __u32 bits_per_block, lab4fs_bitmap_locate_t locate)
 {
-    int bits_per_block;
-    int i;
-    __u32 current_block = start_block;
+    int i, nr_free;
     int nr_valid_bits = bitmap->nr_valid_bits;
-    bits_per_block = sb->s_blocksize << 3;
-    rwlock_init(&bitmap->rwlock);
-    write_lock(&bitmap->rwlock);
     bitmap->log_nr_bits_per_block = log2(bits_per_block);
     bitmap->nr_bits_per_block = bits_per_block;
+    bitmap->sb = sb;
+    spin_lock_init(&bitmap->lru_lock);
+    INIT_LIST_HEAD(&bitmap->lru);
+    bitmap->nr_cached = 0;
 
     bitmap->nr_bhs = nr_valid_bits >> bitmap->log_nr_bits_per_block;
     if (nr_valid_bits % bits_per_block)
         bitmap->nr_bhs++;
-    bitmap->bhs = kmalloc(sizeof(struct buffer_head *) * bitmap->nr_bhs, GFP_KERNEL);
-    if (bitmap->bhs == NULL)
+    bitmap->blocks = vmalloc(sizeof(struct lab4fs_bitmap_block) *
+            bitmap->nr_bhs);
+    if (bitmap->blocks == NULL)
         return -ENOMEM;
 
-    for(i = 0; i < bitmap->nr_bhs; i++) {
-        struct buffer_head *bh;
-		bh = sb_bread(sb, current_block);
-        if (!bh) {
-            LAB4ERROR("Cannot load bitmap at block %u\n", current_block);
-            write_unlock(&bitmap->rwlock);
-            return -EIO;
-        }
-        bitmap->bhs[i] = bh;
+    bitmap->nr_summary = (bitmap->nr_bhs + LAB4FS_BITMAP_SUMMARY_SPAN - 1)
+        >> LAB4FS_BITMAP_SUMMARY_SHIFT;
+    bitmap->summary = vmalloc(sizeof(atomic_t) * bitmap->nr_summary);
+    if (bitmap->summary == NULL) {
+        vfree(bitmap->blocks);
+        bitmap->blocks = NULL;
+        return -ENOMEM;
+    }
+    for (i = 0; i < bitmap->nr_summary; i++)
+        atomic_set(&bitmap->summary[i], 0);
+
+    for (i = 0; i < bitmap->nr_bhs; i++) {
+        spin_lock_init(&bitmap->blocks[i].lock);
+        bitmap->blocks[i].blocknr = locate(sb, i, &nr_free);
+        if (nr_free < 0)
+            nr_free = 1;
+        else if (nr_free > bitmap_block_limit(bitmap, i))
+            nr_free = bitmap_block_limit(bitmap, i);
+        bitmap->blocks[i].nr_free = nr_free;
+        bitmap->blocks[i].counted = 0;
+        bitmap->blocks[i].bh = NULL;
+        INIT_LIST_HEAD(&bitmap->blocks[i].lru);
+        atomic_add(nr_free, &bitmap->summary[i >> LAB4FS_BITMAP_SUMMARY_SHIFT]);
     }
-    write_unlock(&bitmap->rwlock);
     return 0;
 }
 
+void bitmap_destroy(struct lab4fs_bitmap *bitmap)
+{
+    struct lab4fs_bitmap_block *blk;
+    if (bitmap->blocks == NULL)
+        return;
+    while (!list_empty(&bitmap->lru)) {
+        blk = list_entry(bitmap->lru.next, struct lab4fs_bitmap_block, lru);
+        list_del_init(&blk->lru);
+        brelse(blk->bh);
+        blk->bh = NULL;
+    }
+    bitmap->nr_cached = 0;
+    vfree(bitmap->blocks);
+    vfree(bitmap->summary);
+    bitmap->blocks = NULL;
+    bitmap->summary = NULL;
+    bitmap->nr_bhs = 0;
+}
+
+/*
+ * Number of zero bits in the whole bitmap.  Blocks never read count as
+ * set up, so this is exact only once every block has been used.
+ */
+int bitmap_nr_free(struct lab4fs_bitmap *bitmap)
+{
+    int i, nr_free = 0;
+    for (i = 0; i < bitmap->nr_summary; i++)
+        nr_free += atomic_read(&bitmap->summary[i]);
+    return nr_free;
+}
+
 void bitmap_set_bit(struct lab4fs_bitmap *bitmap, int nr)
 {
-    __u32 n, offset;
-    void *data;
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    int n;
+    __u32 offset;
     if (unlikely(nr < 0 || nr >= bitmap->nr_valid_bits))
         return;
-    write_lock(&bitmap->rwlock);
-    n = nr >> bitmap->log_nr_bits_per_block;
-    offset = nr % bitmap->nr_bits_per_block;
-    data = bitmap->bhs[n]->b_data;
-    set_bit(offset, data);
-    mark_buffer_dirty(bitmap->bhs[n]);
-    write_unlock(&bitmap->rwlock);
+    blk = bitmap_locate(bitmap, nr, &n, &offset);
+    if (!(bh = bitmap_get_block(bitmap, n)))
+        return;
+    spin_lock(&blk->lock);
+    if (!__test_and_set_bit(offset, bh->b_data))
+        bitmap_account(bitmap, n, -1);
+    spin_unlock(&blk->lock);
+    mark_buffer_dirty(bh);
+    brelse(bh);
 }
 
+/*
+ * The test functions return the old bit as 0 or 1 (the bitops only
+ * promise nonzero), or -1 if nr is out of range or cannot be read.
+ */
 int bitmap_test_and_set_bit(struct lab4fs_bitmap *bitmap, int nr)
 {
-    __u32 n, offset;
-    void *data;
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    int n;
+    __u32 offset;
     int ret;
     if (unlikely(nr < 0 || nr >= bitmap->nr_valid_bits))
         return -1;
-    write_lock(&bitmap->rwlock);
-    n = nr >> bitmap->log_nr_bits_per_block;
-    offset = nr % bitmap->nr_bits_per_block;
-    data = bitmap->bhs[n]->b_data;
-    ret = test_and_set_bit(offset, data);
+    blk = bitmap_locate(bitmap, nr, &n, &offset);
+    if (!(bh = bitmap_get_block(bitmap, n)))
+        return -1;
+    spin_lock(&blk->lock);
+    ret = __test_and_set_bit(offset, bh->b_data) != 0;
     if (!ret)
-        mark_buffer_dirty(bitmap->bhs[n]);
-    write_unlock(&bitmap->rwlock);
+        bitmap_account(bitmap, n, -1);
+    spin_unlock(&blk->lock);
+    if (!ret)
+        mark_buffer_dirty(bh);
+    brelse(bh);
     return ret;
 }
 
 void bitmap_clear_bit(struct lab4fs_bitmap *bitmap, int nr)
 {
-    __u32 n, offset;
-    void *data;
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    int n;
+    __u32 offset;
     if (unlikely(nr < 0 || nr >= bitmap->nr_valid_bits))
         return;
-    write_lock(&bitmap->rwlock);
-    n = nr >> bitmap->log_nr_bits_per_block;
-    offset = nr % bitmap->nr_bits_per_block;
-    data = bitmap->bhs[n]->b_data;
-    clear_bit(offset, data);
-    mark_buffer_dirty(bitmap->bhs[n]);
-    write_unlock(&bitmap->rwlock);
+    blk = bitmap_locate(bitmap, nr, &n, &offset);
+    if (!(bh = bitmap_get_block(bitmap, n)))
+        return;
+    spin_lock(&blk->lock);
+    if (__test_and_clear_bit(offset, bh->b_data))
+        bitmap_account(bitmap, n, 1);
+    spin_unlock(&blk->lock);
+    mark_buffer_dirty(bh);
+    brelse(bh);
 }
 
 int bitmap_test_and_clear_bit(struct lab4fs_bitmap *bitmap, int nr)
 {
-    __u32 n, offset;
-    void *data;
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    int n;
+    __u32 offset;
     int ret;
     if (unlikely(nr < 0 || nr >= bitmap->nr_valid_bits))
         return -1;
-    write_lock(&bitmap->rwlock);
-    n = nr >> bitmap->log_nr_bits_per_block;
-    offset = nr % bitmap->nr_bits_per_block;
-    data = bitmap->bhs[n]->b_data;
-    ret = test_and_clear_bit(offset, data);
+    blk = bitmap_locate(bitmap, nr, &n, &offset);
+    if (!(bh = bitmap_get_block(bitmap, n)))
+        return -1;
+    spin_lock(&blk->lock);
+    ret = __test_and_clear_bit(offset, bh->b_data) != 0;
+    if (ret)
+        bitmap_account(bitmap, n, 1);
+    spin_unlock(&blk->lock);
     if (ret)
-        mark_buffer_dirty(bitmap->bhs[n]);
-    write_unlock(&bitmap->rwlock);
+        mark_buffer_dirty(bh);
+    brelse(bh);
     return ret;
 }
 
 int bitmap_test_bit(struct lab4fs_bitmap *bitmap, int nr)
 {
-    __u32 n, offset;
-    void *data;
-    int ret;
+    struct buffer_head *bh;
+    int n, ret;
+    __u32 offset;
     if (unlikely(nr < 0 || nr >= bitmap->nr_valid_bits))
         return -1;
-    read_lock(&bitmap->rwlock);
-    n = nr >> bitmap->log_nr_bits_per_block;
-    offset = nr % bitmap->nr_bits_per_block;
-    data = bitmap->bhs[n]->b_data;
-    ret = test_bit(offset, data);
-    read_unlock(&bitmap->rwlock);
+    bitmap_locate(bitmap, nr, &n, &offset);
+    if (!(bh = bitmap_get_block(bitmap, n)))
+        return -1;
+    /* A single bit read needs no lock */
+    ret = test_bit(offset, bh->b_data) != 0;
+    brelse(bh);
     return ret;
 }
 
-__u32 bitmap_find_next_zero_bit(struct lab4fs_bitmap *bitmap, int off, int set)
+/*
+ * Find the first zero bit in [off, end) and, unless max is 0, claim it
+ * together with the zero bits right after it, up to max bits and not
+ * past the end of its bitmap block.  Runs of blocks whose summary says
+ * they are full, and full blocks, are skipped without touching their
+ * data.  Only the lock of the bitmap block being searched is held, so
+ * a concurrent allocator working on another block is never blocked.
+ * Return the number of bits claimed (1 for a bare search), 0 if the
+ * range has no zero bit; *found is the first bit.
+ */
+static int bitmap_search(struct lab4fs_bitmap *bitmap, int off, int end,
+        int max, __u32 *found)
 {
-    __u32 n, offset;
-    void *data;
-    __u32 ret, i;
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    __u32 offset, limit;
+    __u32 i, j;
+    int n;
     if (unlikely(off < 0 || off >= bitmap->nr_valid_bits))
-        return -1;
+        return 0;
+    if (end > bitmap->nr_valid_bits)
+        end = bitmap->nr_valid_bits;
 
-    if (set)
-        write_lock(&bitmap->rwlock);
-    else
-        read_lock(&bitmap->rwlock);
-    n = off >> bitmap->log_nr_bits_per_block;
-    offset = off % bitmap->nr_bits_per_block;
-    ret = 0;
-    i = -1;
-
-    data = bitmap->bhs[n]->b_data;
-    i = find_next_zero_bit(data, bitmap->nr_bits_per_block, offset);
-    ret = n << bitmap->log_nr_bits_per_block;
-    if (i < 0 || i < off || i >= bitmap->nr_bits_per_block) {
-        offset = 0;
-        for (n++; n < bitmap->nr_bhs; n++) {
-            i = -1;
-            data = bitmap->bhs[n]->b_data;
-            i = find_next_zero_bit(data, bitmap->nr_bits_per_block, 0);
-            if (i < 0 || i >= bitmap->nr_bits_per_block) {
-                ret += bitmap->nr_bits_per_block;
-                continue;
-            } else {
-                ret += i;
-                if (ret > bitmap->nr_valid_bits)
-                    goto failed;
-                goto got_it;
+    blk = bitmap_locate(bitmap, off, &n, &offset);
+    while (n < bitmap->nr_bhs && (n << bitmap->log_nr_bits_per_block) < end) {
+        if (!atomic_read(&bitmap->summary[n >> LAB4FS_BITMAP_SUMMARY_SHIFT])) {
+            /* The whole run is full, go to the next one */
+            n = (n | (LAB4FS_BITMAP_SUMMARY_SPAN - 1)) + 1;
+            blk = &bitmap->blocks[n];
+            offset = 0;
+            continue;
+        }
+        /*
+         * nr_free is only a hint here, it is rechecked under the lock.
+         * A block which cannot be read is treated as full.
+         */
+        if (blk->nr_free && (bh = bitmap_get_block(bitmap, n)) != NULL) {
+            limit = bitmap_block_limit(bitmap, n);
+            if (end - (n << bitmap->log_nr_bits_per_block) < limit)
+                limit = end - (n << bitmap->log_nr_bits_per_block);
+            spin_lock(&blk->lock);
+            i = find_next_zero_bit((unsigned long *)bh->b_data, limit,
+                    offset);
+            if (i < limit) {
+                j = i + 1;
+                if (max) {
+                    if (limit - i > max)
+                        limit = i + max;
+                    j = find_next_bit((unsigned long *)bh->b_data,
+                            limit, i);
+                    if (j > limit)
+                        j = limit;
+                    for (offset = i; offset < j; offset++)
+                        __set_bit(offset, bh->b_data);
+                    bitmap_account(bitmap, n, -(int)(j - i));
+                }
+                spin_unlock(&blk->lock);
+                if (max)
+                    mark_buffer_dirty(bh);
+                brelse(bh);
+                *found = (n << bitmap->log_nr_bits_per_block) + i;
+                return j - i;
             }
+            spin_unlock(&blk->lock);
+            brelse(bh);
         }
-    } else {
-        ret += i;
+        n++;
+        blk++;
+        offset = 0;
     }
+    return 0;
+}
 
-got_it:
-    if (set) {
-        set_bit(i, data);
-        mark_buffer_dirty(bitmap->bhs[n]);
-        write_unlock(&bitmap->rwlock);
-    } else
-        read_unlock(&bitmap->rwlock);
+/*
+ * Find the first zero bit in [off, end), and set it if asked to.
+ * Return nr_valid_bits + 1 if there is no zero bit in the range.
+ */
+__u32 bitmap_find_zero_bit_range(struct lab4fs_bitmap *bitmap, int off,
+        int end, int set)
+{
+    __u32 found;
 
-    return ret;
+    if (!bitmap_search(bitmap, off, end, set ? 1 : 0, &found))
+        return bitmap->nr_valid_bits + 1;
+    return found;
+}
 
-failed:
-    if (set)
-        write_unlock(&bitmap->rwlock);
-    else
-        read_unlock(&bitmap->rwlock);
-    return bitmap->nr_valid_bits + 1;
+/*
+ * Find the first zero bit at or after off, and set it if asked to.
+ * Return nr_valid_bits + 1 if there is no zero bit left.
+ */
+__u32 bitmap_find_next_zero_bit(struct lab4fs_bitmap *bitmap, int off, int set)
+{
+    return bitmap_find_zero_bit_range(bitmap, off, bitmap->nr_valid_bits, set);
 }
 
+/*
+ * Claim the first run of zero bits in [off, end), at most max bits
+ * long, with a single lock round-trip.  *start is set to the first bit
+ * of the run and its length is returned, 0 if there is no zero bit.
+ */
+int bitmap_claim_zero_run(struct lab4fs_bitmap *bitmap, int off, int end,
+        int max, __u32 *start)
+{
+    if (max <= 0)
+        return 0;
+    return bitmap_search(bitmap, off, end, max, start);
+}
+
+/*
+ * Clear count bits starting at nr, taking the lock of each bitmap block
+ * once.  Return how many bits were really set before.
+ */
+int bitmap_clear_run(struct lab4fs_bitmap *bitmap, int nr, int count)
+{
+    struct lab4fs_bitmap_block *blk;
+    struct buffer_head *bh;
+    __u32 offset, limit;
+    int n, cleared = 0, freed;
+    if (unlikely(nr < 0 || count <= 0 || nr + count > bitmap->nr_valid_bits))
+        return 0;
+
+    blk = bitmap_locate(bitmap, nr, &n, &offset);
+    while (count > 0) {
+        limit = offset + count;
+        if (limit > bitmap->nr_bits_per_block)
+            limit = bitmap->nr_bits_per_block;
+        count -= limit - offset;
+        freed = 0;
+        if (!(bh = bitmap_get_block(bitmap, n)))
+            goto next;
+        spin_lock(&blk->lock);
+        for (; offset < limit; offset++)
+            if (__test_and_clear_bit(offset, bh->b_data))
+                freed++;
+        bitmap_account(bitmap, n, freed);
+        spin_unlock(&blk->lock);
+        if (freed)
+            mark_buffer_dirty(bh);
+        brelse(bh);
+        cleared += freed;
+next:
+        n++;
+        blk++;
+        offset = 0;
+    }
+    return cleared;
+}
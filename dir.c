@@ -1,12 +1,6 @@
 #include "lab4fs.h"
 #include <linux/time.h>
 
-static inline void lab4fs_put_page(struct page *page)
-{
-	kunmap(page);
-	page_cache_release(page);
-}
-
 static inline unsigned long dir_pages(struct inode *inode)
 {
 	return (inode->i_size+PAGE_CACHE_SIZE-1)>>PAGE_CACHE_SHIFT;
@@ -26,7 +20,7 @@ lab4fs_last_byte(struct inode *inode, unsigned long page_nr)
 /* TODO */
 #define lab4fs_check_page(page) 
 
-static struct page *lab4fs_get_page(struct inode *dir, unsigned long n)
+struct page *lab4fs_get_page(struct inode *dir, unsigned long n)
 {
     struct address_space *mapping = dir->i_mapping;
 	struct page *page = read_cache_page(mapping, n,
@@ -48,21 +42,46 @@ fail:
     return ERR_PTR(-EIO);
 }
 
-static inline int lab4fs_match(int len, const char *const name,
-        struct lab4fs_dir_entry *de)
-{
-    if (len != de->name_len)
-        return 0;
-    if (!de->inode)
-        return 0;
-    return !memcmp(name, de->name, len);
-}
+/* How many pages a directory scan keeps asked for ahead of itself */
+#define LAB4FS_DIR_READAHEAD    32
 
-static inline struct lab4fs_dir_entry *
-lab4fs_next_entry(struct lab4fs_dir_entry *p)
+/*
+ * A scan of dir is at page n, and has asked for the pages before ra to
+ * be read.  Once it gets within half a window of ra, start reading the
+ * next uncached pages in one go through ->readpages, the way the page
+ * cache reads ahead for files, and return where that stopped.
+ */
+unsigned long lab4fs_dir_readahead(struct inode *dir, unsigned long n,
+        unsigned long ra)
 {
-    return (struct lab4fs_dir_entry *)
-        ((char *)p + le16_to_cpu(p->rec_len));
+    struct address_space *mapping = dir->i_mapping;
+    unsigned long end = dir_pages(dir);
+    struct page *page;
+    LIST_HEAD(pages);
+    unsigned nr = 0;
+
+    if (ra > n + LAB4FS_DIR_READAHEAD / 2)
+        return ra;
+    if (ra < n)
+        ra = n;
+    if (end > n + LAB4FS_DIR_READAHEAD)
+        end = n + LAB4FS_DIR_READAHEAD;
+    for (; ra < end; ra++) {
+        page = find_get_page(mapping, ra);
+        if (page) {
+            page_cache_release(page);
+            continue;
+        }
+        page = page_cache_alloc_cold(mapping);
+        if (!page)
+            break;
+        page->index = ra;
+        list_add(&page->lru, &pages);
+        nr++;
+    }
+    if (nr)
+        mapping->a_ops->readpages(NULL, mapping, &pages, nr);
+    return ra;
 }
 
 static inline void lab4fs_inc_count(struct inode *inode)
@@ -99,7 +118,7 @@ static inline void lab4fs_set_de_type(struct lab4fs_dir_entry *de, struct inode
     de->file_type = lab4fs_type_by_mode[(mode & S_IFMT)>>S_SHIFT];
 }
 
-static int lab4fs_commit_chunk(struct page *page, unsigned from, unsigned to)
+int lab4fs_commit_chunk(struct page *page, unsigned from, unsigned to)
 {
     struct inode *dir = page->mapping->host;
     int err = 0;
@@ -117,6 +136,304 @@ static int lab4fs_commit_chunk(struct page *page, unsigned from, unsigned to)
     return err;
 }
 
+/*
+ * Replace block b of dir with data.  b may be the block right after the
+ * end of dir, which then grows by it.
+ */
+int lab4fs_write_dir_block(struct inode *dir, unsigned long b, char *data)
+{
+    unsigned bs = dir->i_sb->s_blocksize;
+    int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+    struct page *page;
+    unsigned from;
+    int err;
+
+    page = lab4fs_get_page(dir, b >> shift);
+    if (IS_ERR(page)) {
+        LAB4ERROR("cannot read block %lu of directory #%lu\n", b,
+                dir->i_ino);
+        return PTR_ERR(page);
+    }
+    from = (b & ((1 << shift) - 1)) << dir->i_blkbits;
+    lock_page(page);
+    err = page->mapping->a_ops->prepare_write(NULL, page, from, from + bs);
+    if (err) {
+        unlock_page(page);
+        goto out;
+    }
+    memcpy((char *)page_address(page) + from, data, bs);
+    err = lab4fs_commit_chunk(page, from, from + bs);
+out:
+    lab4fs_put_page(page);
+    return err;
+}
+
+/*
+ * Write the pages holding blocks from to to - 1 of dir and wait for
+ * them, in block order.  For rewrites that move entries around, which
+ * must be on disk before the blocks they came from are reused.
+ */
+int lab4fs_sync_dir_blocks(struct inode *dir, unsigned long from,
+        unsigned long to)
+{
+    int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+    struct page *page;
+    unsigned long n;
+    int err = 0;
+
+    if (from >= to)
+        return 0;
+    for (n = from >> shift; !err && n <= (to - 1) >> shift; n++) {
+        page = find_lock_page(dir->i_mapping, n);
+        if (!page)
+            continue;
+        err = write_one_page(page, 1);
+        page_cache_release(page);
+    }
+    return err;
+}
+
+/*
+ * Free space map of a linear directory: for every block, the biggest
+ * record lab4fs_add_link could put in it, so that it goes straight to a
+ * block with room instead of walking every entry.  It is built by the
+ * first add_link after the inode is read, for directories of whole
+ * blocks up to LAB4FS_FREE_MAP_MAX of them, and only kept in memory.
+ * No block before i_dir_free_first has room for any name.
+ */
+#define LAB4FS_FREE_MAP_MAX     32768
+
+/* The room of one block, 0 if it is broken */
+static unsigned lab4fs_block_room(char *block, unsigned bs)
+{
+    struct lab4fs_dir_entry *de = (struct lab4fs_dir_entry *)block;
+    unsigned room = 0, len;
+
+    while ((char *)de < block + bs) {
+        if (de->rec_len == 0)
+            return 0;
+        len = le16_to_cpu(de->rec_len);
+        if (de->inode)
+            len -= LAB4FS_DIR_REC_LEN(de->name_len);
+        if (len > room)
+            room = len;
+        de = lab4fs_next_entry(de);
+    }
+    return room;
+}
+
+void lab4fs_free_map_drop(struct inode *dir)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+
+    kfree(ei->i_dir_free);
+    ei->i_dir_free = NULL;
+    ei->i_dir_free_size = 0;
+}
+
+static void lab4fs_free_map_set(struct inode *dir, unsigned long b,
+        unsigned room)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+
+    if (b >= ei->i_dir_free_size) {
+        unsigned size = max_t(unsigned, 2 * ei->i_dir_free_size, 16);
+        __u16 *map;
+
+        if (b >= LAB4FS_FREE_MAP_MAX) {
+            lab4fs_free_map_drop(dir);
+            return;
+        }
+        if (size > LAB4FS_FREE_MAP_MAX)
+            size = LAB4FS_FREE_MAP_MAX;
+        map = kmalloc(size * sizeof(*map), GFP_KERNEL);
+        if (!map) {
+            lab4fs_free_map_drop(dir);
+            return;
+        }
+        memset(map, 0, size * sizeof(*map));
+        memcpy(map, ei->i_dir_free, ei->i_dir_free_size * sizeof(*map));
+        kfree(ei->i_dir_free);
+        ei->i_dir_free = map;
+        ei->i_dir_free_size = size;
+    }
+    ei->i_dir_free[b] = room;
+    if (room >= LAB4FS_DIR_REC_LEN(1)) {
+        if (b < ei->i_dir_free_first)
+            ei->i_dir_free_first = b;
+    } else if (b == ei->i_dir_free_first) {
+        while (b < nblocks && ei->i_dir_free[b] < LAB4FS_DIR_REC_LEN(1))
+            b++;
+        ei->i_dir_free_first = b;
+    }
+}
+
+/* The block at offset from in page changed */
+static void lab4fs_free_map_note(struct inode *dir, struct page *page,
+        unsigned from)
+{
+    unsigned bs = lab4fs_chunk_size(dir);
+
+    if (!LAB4FS_I(dir)->i_dir_free)
+        return;
+    from &= ~(bs - 1);
+    lab4fs_free_map_set(dir, ((page->index << PAGE_CACHE_SHIFT) + from) >>
+            dir->i_blkbits,
+            lab4fs_block_room((char *)page_address(page) + from, bs));
+}
+
+/* Make sure dir has a free space map; 0 if it has one */
+static int lab4fs_free_map_build(struct inode *dir)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    unsigned bs = lab4fs_chunk_size(dir);
+    unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+    unsigned long npages = dir_pages(dir), n, ra = 0;
+    unsigned offs;
+
+    if (ei->i_dir_free)
+        return 0;
+    if ((dir->i_size & (bs - 1)) || !nblocks ||
+            nblocks > LAB4FS_FREE_MAP_MAX)
+        return -EINVAL;
+    ei->i_dir_free = kmalloc(nblocks * sizeof(__u16), GFP_KERNEL);
+    if (!ei->i_dir_free)
+        return -ENOMEM;
+    ei->i_dir_free_size = nblocks;
+    ei->i_dir_free_first = nblocks;
+    for (n = 0; n < npages; n++) {
+        struct page *page;
+
+        ra = lab4fs_dir_readahead(dir, n, ra);
+        page = lab4fs_get_page(dir, n);
+        if (IS_ERR(page)) {
+            lab4fs_free_map_drop(dir);
+            return PTR_ERR(page);
+        }
+        for (offs = 0; offs < lab4fs_last_byte(dir, n); offs += bs)
+            lab4fs_free_map_note(dir, page, offs);
+        lab4fs_put_page(page);
+    }
+    return 0;
+}
+
+/*
+ * The first block with room for a record of reclen bytes, or the one
+ * after the end of the directory if there is none.
+ */
+static unsigned long lab4fs_free_map_find(struct inode *dir, unsigned reclen)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+    unsigned long b;
+
+    for (b = ei->i_dir_free_first; b < nblocks; b++)
+        if (ei->i_dir_free[b] >= reclen)
+            break;
+    return b;
+}
+
+/*
+ * Put name for inode in the record de of the locked page: in de itself
+ * if it is unused, else in the room after its name.  The page is
+ * unlocked on return.
+ */
+int lab4fs_insert_entry(struct page *page, struct lab4fs_dir_entry *de,
+        const char *name, int namelen, struct inode *inode)
+{
+    struct inode *dir = page->mapping->host;
+    unsigned short rec_len = le16_to_cpu(de->rec_len);
+    unsigned short name_len = LAB4FS_DIR_REC_LEN(de->name_len);
+    unsigned from, to;
+    int err;
+
+    from = (char *)de - (char *)page_address(page);
+    to = from + rec_len;
+    err = page->mapping->a_ops->prepare_write(NULL, page, from, to);
+    if (err) {
+        unlock_page(page);
+        return err;
+    }
+    if (de->inode) {
+        struct lab4fs_dir_entry *de1 = (struct lab4fs_dir_entry *)
+            ((char *) de + name_len);
+        de1->rec_len = cpu_to_le16(rec_len - name_len);
+        de->rec_len = cpu_to_le16(name_len);
+        de = de1;
+    }
+    de->name_len = namelen;
+    memcpy(de->name, name, namelen);
+    de->inode = cpu_to_le32(inode->i_ino);
+    lab4fs_set_de_type(de, inode);
+    lab4fs_set_de_tag(dir, de);
+    if (LAB4FS_I(dir)->i_dir_live != LAB4FS_DIR_LIVE_UNKNOWN)
+        LAB4FS_I(dir)->i_dir_live += LAB4FS_DIR_REC_LEN(namelen);
+
+    err = lab4fs_commit_chunk(page, from, to);
+    lab4fs_free_map_note(dir, page, from);
+    if (err)
+        lab4fs_name_cache_drop(dir);
+    else
+        lab4fs_name_cache_add(dir, name, namelen,
+                (page->index << PAGE_CACHE_SHIFT) +
+                ((char *)de - (char *)page_address(page)));
+    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+	mark_inode_dirty(dir);
+    return err;
+}
+
+/*
+ * lab4fs_add_link through the free space map: only the block it points
+ * to is read.  Unlike the scan, this does not look for the name among
+ * the others, which the lookup before any link has just failed to find.
+ * -EAGAIN if the map turns out wrong, and is dropped.
+ */
+static int lab4fs_add_link_mapped(struct inode *dir, const char *name,
+        int namelen, struct inode *inode)
+{
+    unsigned bs = lab4fs_chunk_size(dir);
+    unsigned reclen = LAB4FS_DIR_REC_LEN(namelen);
+    int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+    unsigned long b = lab4fs_free_map_find(dir, reclen);
+    struct lab4fs_dir_entry *de;
+    struct page *page;
+    unsigned rec_len;
+    char *block;
+    int err;
+
+    page = lab4fs_get_page(dir, b >> shift);
+    if (IS_ERR(page))
+        return PTR_ERR(page);
+    lock_page(page);
+    block = (char *)page_address(page) +
+        ((b & ((1 << shift) - 1)) << dir->i_blkbits);
+    de = (struct lab4fs_dir_entry *)block;
+    if (b == dir->i_size >> dir->i_blkbits) {
+        de->rec_len = cpu_to_le16(bs);
+        de->inode = 0;
+        goto got_it;
+    }
+    while ((char *)de < block + bs && de->rec_len) {
+        rec_len = le16_to_cpu(de->rec_len);
+        if (de->inode)
+            rec_len -= LAB4FS_DIR_REC_LEN(de->name_len);
+        if (rec_len >= reclen)
+            goto got_it;
+        de = lab4fs_next_entry(de);
+    }
+    unlock_page(page);
+    lab4fs_put_page(page);
+    LAB4ERROR("stale free space map of directory #%lu\n", dir->i_ino);
+    lab4fs_free_map_drop(dir);
+    return -EAGAIN;
+
+got_it:
+    err = lab4fs_insert_entry(page, de, name, namelen, inode);
+    lab4fs_put_page(page);
+    return err;
+}
+
 int lab4fs_add_link (struct dentry *dentry, struct inode *inode)
 {	
     struct inode *dir = dentry->d_parent->d_inode;
@@ -129,10 +446,27 @@ int lab4fs_add_link (struct dentry *dentry, struct inode *inode)
 	struct lab4fs_dir_entry *de;
 	unsigned long npages = dir_pages(dir);
 	unsigned long n;
+	struct lab4fs_name_key key;
 	char *kaddr;
-	unsigned from, to;
 	int err;
 
+    if (LAB4FS_I(dir)->i_flags & LAB4FS_INDEX_FL)
+        return lab4fs_dx_add_link(dentry, inode);
+    if (test_opt(dir->i_sb, DIR_INDEX) && dir->i_size >= chunk_size) {
+        err = lab4fs_dx_build(dir);
+        if (err)
+            return err;
+        if (LAB4FS_I(dir)->i_flags & LAB4FS_INDEX_FL)
+            return lab4fs_dx_add_link(dentry, inode);
+    }
+
+    if (!lab4fs_free_map_build(dir)) {
+        err = lab4fs_add_link_mapped(dir, name, namelen, inode);
+        if (err != -EAGAIN)
+            return err;
+    }
+
+    key = lab4fs_name_key(dir, name, namelen);
     for (n = 0; n <= npages; n++) {
         char *dir_end;
 
@@ -150,13 +484,10 @@ int lab4fs_add_link (struct dentry *dentry, struct inode *inode)
 
         while((char *)de <= kaddr) {
             if ((char *)de == dir_end) {
-                name_len = 0;
-                rec_len = chunk_size;
-                de->rec_len = cpu_to_le16(chunk_size);
-                /*
-                rec_len = reclen;
-                de->rec_len = rec_len;
-                */
+                /* Up to the end of the block, never across it */
+                rec_len = chunk_size - ((dir_end - (char *)page_address(page)) &
+                        (chunk_size - 1));
+                de->rec_len = cpu_to_le16(rec_len);
                 de->inode = 0;
                 goto got_it;
             }
@@ -166,7 +497,7 @@ int lab4fs_add_link (struct dentry *dentry, struct inode *inode)
                 goto out_unlock;
             }
             err = -EEXIST;
-            if (lab4fs_match(namelen, name, de))
+            if (lab4fs_match_key(key, namelen, name, de))
                 goto out_unlock;
             name_len = LAB4FS_DIR_REC_LEN(de->name_len);
             rec_len = le16_to_cpu(de->rec_len);
@@ -184,26 +515,7 @@ int lab4fs_add_link (struct dentry *dentry, struct inode *inode)
     return -EINVAL;
 
 got_it:
-    from = (char *)de - (char *)page_address(page);
-    to = from + rec_len;
-    err = page->mapping->a_ops->prepare_write(NULL, page, from, to);
-    if (err)
-        goto out_unlock;
-    if (de->inode) {
-        struct lab4fs_dir_entry *de1 = (struct lab4fs_dir_entry *)
-            ((char *) de + name_len);
-        de1->rec_len = cpu_to_le16(rec_len - name_len);
-        de->rec_len = cpu_to_le16(name_len);
-        de = de1;
-    }
-    de->name_len = namelen;
-    memcpy(de->name, name, namelen);
-    de->inode = cpu_to_le32(inode->i_ino);
-    lab4fs_set_de_type(de, inode);
-
-    err = lab4fs_commit_chunk(page, from, to);
-    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
-	mark_inode_dirty(dir);
+    err = lab4fs_insert_entry(page, de, name, namelen, inode);
 out_put:
     lab4fs_put_page(page);
 out:
@@ -236,6 +548,32 @@ static unsigned char lab4fs_filetype_table[LAB4FS_FT_MAX] = {
 	[LAB4FS_FT_SYMLINK]	= DT_LNK,
 };
 
+/*
+ * The start of the record at or before offset in the block of base it
+ * is in.  Records move when the directory changes (lab4fs_dx_build,
+ * leaf splits, compaction), so a readdir position saved before that may
+ * no longer be at a record.
+ */
+static unsigned lab4fs_validate_entry(char *base, unsigned offset,
+        unsigned mask)
+{
+	struct lab4fs_dir_entry *de = (struct lab4fs_dir_entry *)(base + offset);
+	struct lab4fs_dir_entry *p =
+        (struct lab4fs_dir_entry *)(base + (offset & mask));
+
+	while ((char *)p < (char *)de) {
+		if (p->rec_len == 0)
+			break;
+		p = lab4fs_next_entry(p);
+	}
+	return (char *)p - base;
+}
+
+/*
+ * Positions are byte offsets in the directory.  After a change that
+ * moved records, the position is taken back to a record boundary; a
+ * name moved from after the position to before it is not returned.
+ */
 static int
 lab4fs_readdir (struct file * filp, void * dirent, filldir_t filldir)
 {
@@ -244,6 +582,9 @@ lab4fs_readdir (struct file * filp, void * dirent, filldir_t filldir)
     unsigned int offset = pos & ~PAGE_CACHE_MASK;
     unsigned long n = pos >> PAGE_CACHE_SHIFT;
     unsigned long npages = dir_pages(inode);
+    unsigned chunk_mask = ~(lab4fs_chunk_size(inode) - 1);
+    int need_revalidate = filp->f_version != inode->i_version;
+    unsigned long ra = 0;
 	unsigned char *types = NULL;
 	int ret;
 
@@ -260,15 +601,25 @@ lab4fs_readdir (struct file * filp, void * dirent, filldir_t filldir)
     for (; n < npages; n++, offset = 0) {
         char *kaddr, *limit;
         struct lab4fs_dir_entry *de;
+        struct page *page;
 
-        struct page *page = lab4fs_get_page(inode, n);
+        ra = lab4fs_dir_readahead(inode, n, ra);
+        page = lab4fs_get_page(inode, n);
 
         if(IS_ERR(page)) {
             LAB4ERROR("bad page in #%lu\n", inode->i_ino);
-            filp->f_op += PAGE_CACHE_SIZE - offset;
+            filp->f_pos += PAGE_CACHE_SIZE - offset;
             continue;
         }
 		kaddr = page_address(page);
+		if (need_revalidate) {
+			if (offset) {
+				offset = lab4fs_validate_entry(kaddr, offset, chunk_mask);
+				filp->f_pos = (n << PAGE_CACHE_SHIFT) + offset;
+			}
+			filp->f_version = inode->i_version;
+			need_revalidate = 0;
+		}
 		de = (struct lab4fs_dir_entry *)(kaddr+offset);
 		limit = kaddr + lab4fs_last_byte(inode, n) - LAB4FS_DIR_REC_LEN(1);
 		for ( ;(char*)de <= limit; de = lab4fs_next_entry(de)) {
@@ -282,7 +633,7 @@ lab4fs_readdir (struct file * filp, void * dirent, filldir_t filldir)
                 int over;
                 unsigned char d_type = DT_UNKNOWN;
 
-                d_type = types[de->file_type];
+                d_type = types[de->file_type & LAB4FS_FT_MASK];
 
                 offset = (char *)de - kaddr;
 #ifdef CONFIG_LAB4FS_DEBUG
@@ -325,15 +676,30 @@ struct lab4fs_dir_entry * lab4fs_find_entry (struct inode * dir,
 	const char *name = dentry->d_name.name;
 	int namelen = dentry->d_name.len;
 	unsigned reclen = LAB4FS_DIR_REC_LEN(namelen);
-	unsigned long start, n;
+	unsigned long start, n, ra = 0;
 	unsigned long npages = dir_pages(dir);
 	struct page *page = NULL;
     struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    struct lab4fs_name_key key = lab4fs_name_key(dir, name, namelen);
     struct lab4fs_dir_entry *de;
 
     if (npages == 0)
         goto out;
 
+    /*
+     * "." and ".." are neither in the index nor in the name cache; a
+     * broken index or a cache that cannot tell falls back to the scan.
+     */
+    if (!lab4fs_is_dot(name, namelen)) {
+        if (ei->i_flags & LAB4FS_INDEX_FL) {
+            if (!lab4fs_dx_find_entry(dir, name, namelen, &de, res_page))
+                return de;
+        } else if (test_opt(dir->i_sb, NAME_CACHE)) {
+            if (!lab4fs_name_cache_find(dir, name, namelen, &de, res_page))
+                return de;
+        }
+    }
+
 	/* OFFSET_CACHE */
 	*res_page = NULL;
 
@@ -343,6 +709,7 @@ struct lab4fs_dir_entry * lab4fs_find_entry (struct inode * dir,
 	n = start;
     do {
         char *kaddr;
+        ra = lab4fs_dir_readahead(dir, n, ra);
         page = lab4fs_get_page(dir, n);
         if (!IS_ERR(page)) {
             kaddr = page_address(page);
@@ -354,19 +721,20 @@ struct lab4fs_dir_entry * lab4fs_find_entry (struct inode * dir,
                     lab4fs_put_page(page);
                     goto out;
                 }
-                if (lab4fs_match(namelen, name, de))
+                if (lab4fs_match_key(key, namelen, name, de))
                     goto found;
                 de = lab4fs_next_entry(de);
             }
             lab4fs_put_page(page);
         }
         if (++n >= npages)
-            n = 0;
+            n = ra = 0;
     } while (n != start);
 out:
     return NULL;
 found:
     *res_page = page;
+    ei->i_dir_start_lookup = n;
     return de;
 }
 
@@ -468,7 +836,7 @@ static int lab4fs_create(struct inode *dir,
     struct inode *inode = lab4fs_new_inode(dir, mode);
 	int err = PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
-		inode->i_op = &simple_dir_inode_operations;
+		inode->i_op = &lab4fs_file_inode_operations;
 		inode->i_fop = &lab4fs_file_operations;
         inode->i_mapping->a_ops = &lab4fs_aops;
 		mark_inode_dirty(inode);
@@ -501,10 +869,195 @@ static int lab4fs_rmdir(struct inode *dir, struct dentry *dentry)
     return err;
 }
 
+/*
+ * Call fn on every live record of dir, in block order; its "." and ".."
+ * come first.  Stop at the first error fn returns.
+ */
+static int lab4fs_for_each_entry(struct inode *dir,
+        int (*fn)(struct lab4fs_dir_entry *, void *), void *data)
+{
+    unsigned long npages = dir_pages(dir), n, ra = 0;
+    int err = 0;
+
+    for (n = 0; n < npages && !err; n++) {
+        struct lab4fs_dir_entry *de;
+        struct page *page;
+        char *kaddr, *limit;
+
+        ra = lab4fs_dir_readahead(dir, n, ra);
+        page = lab4fs_get_page(dir, n);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        kaddr = page_address(page);
+        limit = kaddr + lab4fs_last_byte(dir, n) - LAB4FS_DIR_REC_LEN(1);
+        for (de = (struct lab4fs_dir_entry *)kaddr; (char *)de <= limit;
+                de = lab4fs_next_entry(de)) {
+            if (de->rec_len == 0) {
+                LAB4ERROR("zero-length dir entry\n");
+                err = -EIO;
+                break;
+            }
+            if (de->inode) {
+                err = fn(de, data);
+                if (err)
+                    break;
+            }
+        }
+        lab4fs_put_page(page);
+    }
+    return err;
+}
+
+/*
+ * Records packed from the start of a directory, in order, each block
+ * ending where the next record would not fit.  pool is NULL while only
+ * the size is worked out.
+ */
+struct lab4fs_pack {
+    unsigned bs;
+    unsigned live;          /* bytes of all records */
+    unsigned long nblocks;  /* blocks begun */
+    unsigned used;          /* in the last one */
+    char *pool;
+};
+
+static int lab4fs_pack_entry(struct lab4fs_dir_entry *de, void *data)
+{
+    struct lab4fs_pack *pack = data;
+    unsigned size = LAB4FS_DIR_REC_LEN(de->name_len);
+
+    if (!pack->nblocks || pack->used + size > pack->bs) {
+        pack->nblocks++;
+        pack->used = 0;
+    }
+    if (pack->pool) {
+        memcpy(pack->pool + pack->live, de, size);
+        ((struct lab4fs_dir_entry *)(pack->pool + pack->live))->rec_len =
+            cpu_to_le16(size);
+    }
+    pack->used += size;
+    pack->live += size;
+    return 0;
+}
+
+/*
+ * Pack the records of dir into as few blocks as will hold them, keeping
+ * their order, and cut off the blocks left over.  With sparse_only this
+ * is only done if under 1/LAB4FS_COMPACT_RATIO of the directory is in
+ * use.  An indexed directory is written out linear and indexed again,
+ * so it is only compacted while lab4fs_dx_build takes the result.
+ *
+ * Called under i_sem.  A readdir half way through may miss the names
+ * moved from after its position to before it.
+ */
+int lab4fs_dir_compact(struct inode *dir, int sparse_only)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    unsigned bs = dir->i_sb->s_blocksize;
+    unsigned long nblocks = (dir->i_size + bs - 1) >> dir->i_blkbits;
+    int indexed = ei->i_flags & LAB4FS_INDEX_FL;
+    int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+    struct lab4fs_pack pack;
+    struct lab4fs_dir_entry *de;
+    unsigned offs, size;
+    unsigned long b;
+    char *buf = NULL;
+    int err;
+
+    memset(&pack, 0, sizeof(pack));
+    pack.bs = bs;
+    err = lab4fs_for_each_entry(dir, lab4fs_pack_entry, &pack);
+    if (err)
+        return err;
+    ei->i_dir_live = pack.live;
+    if (sparse_only && pack.live * LAB4FS_COMPACT_RATIO > dir->i_size)
+        return 0;
+    if (pack.nblocks >= nblocks)
+        return 0;
+    if (indexed && pack.nblocks > LAB4FS_DX_BUILD_BLOCKS)
+        return 0;
+
+    err = -ENOMEM;
+    pack.pool = vmalloc(pack.live);
+    buf = kmalloc(bs, GFP_KERNEL);
+    if (!pack.pool || !buf)
+        goto out;
+    pack.live = pack.nblocks = 0;
+    err = lab4fs_for_each_entry(dir, lab4fs_pack_entry, &pack);
+    if (err)
+        goto out;
+
+    lab4fs_name_cache_drop(dir);
+    lab4fs_free_map_drop(dir);
+    for (b = 0, offs = 0; b < pack.nblocks; b++) {
+        memset(buf, 0, bs);
+        for (size = 0, de = NULL; offs < pack.live; ) {
+            struct lab4fs_dir_entry *p =
+                (struct lab4fs_dir_entry *)(pack.pool + offs);
+            unsigned len = le16_to_cpu(p->rec_len);
+
+            if (size + len > bs)
+                break;
+            de = (struct lab4fs_dir_entry *)(buf + size);
+            memcpy(de, p, len);
+            size += len;
+            offs += len;
+        }
+        de->rec_len = cpu_to_le16(le16_to_cpu(de->rec_len) + bs - size);
+        err = lab4fs_write_dir_block(dir, b, buf);
+        if (err)
+            goto out;
+        /*
+         * Names only move to earlier blocks, so each page must reach
+         * the disk before the next one overwrites where they were.
+         */
+        if (b + 1 == pack.nblocks || !((b + 1) & ((1 << shift) - 1))) {
+            err = lab4fs_sync_dir_blocks(dir, b, b + 1);
+            if (err)
+                goto out;
+        }
+    }
+
+    LAB4DEBUG("compacted directory #%lu from %lu to %lu blocks\n",
+            dir->i_ino, nblocks, pack.nblocks);
+    ei->i_flags &= ~LAB4FS_INDEX_FL;
+    ei->i_dir_start_lookup = 0;
+    dir->i_size = pack.nblocks << dir->i_blkbits;
+    truncate_inode_pages(dir->i_mapping, dir->i_size);
+    lab4fs_truncate(dir);
+    dir->i_mtime = dir->i_ctime = CURRENT_TIME;
+    mark_inode_dirty(dir);
+    if (indexed)
+        err = lab4fs_dx_build(dir);
+out:
+    vfree(pack.pool);
+    kfree(buf);
+    return err;
+}
+
+/* Whether a delete from dir should try lab4fs_dir_compact */
+static int lab4fs_dir_wants_compact(struct inode *dir)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    unsigned bs = lab4fs_chunk_size(dir);
+
+    if (dir->i_size < LAB4FS_COMPACT_MIN_BLOCKS * bs)
+        return 0;
+    /* Counted on the first delete after the inode is read */
+    if (ei->i_dir_live == LAB4FS_DIR_LIVE_UNKNOWN)
+        return 1;
+    if (ei->i_dir_live * LAB4FS_COMPACT_RATIO > dir->i_size)
+        return 0;
+    /* Half full blocks at worst, and the index must not be lost */
+    return !(ei->i_flags & LAB4FS_INDEX_FL) ||
+        ei->i_dir_live <= LAB4FS_DX_BUILD_BLOCKS * bs / 2;
+}
+
 int lab4fs_delete_entry (struct lab4fs_dir_entry *dir, struct page * page )
 {
     struct address_space *mapping = page->mapping;
 	struct inode *inode = mapping->host;
+	struct lab4fs_inode_info *ei = LAB4FS_I(inode);
 	char *kaddr = page_address(page);
 	unsigned from = ((char*)dir - kaddr) & ~(lab4fs_chunk_size(inode)-1);
 	unsigned to = ((char*)dir - kaddr) + le16_to_cpu(dir->rec_len);
@@ -533,12 +1086,24 @@ int lab4fs_delete_entry (struct lab4fs_dir_entry *dir, struct page * page )
 		BUG();
 	if (pde)
 		pde->rec_len = cpu_to_le16(to-from);
+	lab4fs_name_cache_remove(inode, dir->name, dir->name_len,
+			(page->index << PAGE_CACHE_SHIFT) + ((char *)dir - kaddr));
+	if (ei->i_dir_live != LAB4FS_DIR_LIVE_UNKNOWN)
+		ei->i_dir_live -= LAB4FS_DIR_REC_LEN(dir->name_len);
 	dir->inode = 0;
 	err = lab4fs_commit_chunk(page, from, to);
+	lab4fs_free_map_note(inode, page, from);
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME;
 	mark_inode_dirty(inode);
 out:
     lab4fs_put_page(page);
+    if (!err && lab4fs_dir_wants_compact(inode)) {
+        /* Records must not move under the position of an open file */
+        if (atomic_read(&ei->i_dir_opens))
+            ei->i_dir_compact = 1;
+        else
+            lab4fs_dir_compact(inode, 1);
+    }
     return err;
 }
 
@@ -570,8 +1135,55 @@ struct inode_operations lab4fs_dir_inode_operations = {
     .rmdir      = lab4fs_rmdir,
 };
 
+static int lab4fs_dir_ioctl(struct inode *inode, struct file *filp,
+        unsigned int cmd, unsigned long arg)
+{
+    int err;
+
+    switch (cmd) {
+    case LAB4FS_IOC_COMPACT_DIR:
+        if (IS_RDONLY(inode))
+            return -EROFS;
+        if (current->fsuid != inode->i_uid && !capable(CAP_FOWNER))
+            return -EACCES;
+        down(&inode->i_sem);
+        err = lab4fs_dir_compact(inode, 0);
+        up(&inode->i_sem);
+        return err;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static int lab4fs_dir_open(struct inode *inode, struct file *filp)
+{
+    atomic_inc(&LAB4FS_I(inode)->i_dir_opens);
+    return 0;
+}
+
+/* The compaction deletes asked for while the directory was open */
+static int lab4fs_dir_release(struct inode *inode, struct file *filp)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    if (!atomic_dec_and_test(&ei->i_dir_opens) || !ei->i_dir_compact)
+        return 0;
+    down(&inode->i_sem);
+    if (!atomic_read(&ei->i_dir_opens) && ei->i_dir_compact) {
+        ei->i_dir_compact = 0;
+        if (inode->i_nlink && !IS_RDONLY(inode) &&
+                lab4fs_dir_wants_compact(inode))
+            lab4fs_dir_compact(inode, 1);
+    }
+    up(&inode->i_sem);
+    return 0;
+}
+
 struct file_operations lab4fs_dir_operations = {
 	.llseek		= generic_file_llseek,
 	.read		= generic_read_dir,
 	.readdir	= lab4fs_readdir,
+	.ioctl		= lab4fs_dir_ioctl,
+	.open		= lab4fs_dir_open,
+	.release	= lab4fs_dir_release,
 };
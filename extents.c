@@ -0,0 +1,614 @@
+#include "lab4fs.h"
+
+/*
+ * Extent mapped inodes.
+ *
+ * An inode with LAB4FS_EXTENTS_FL keeps in i_block, instead of block
+ * pointers, the root of a tree of extents: runs of logically and
+ * physically contiguous blocks.  Index and extent entries are both 12
+ * bytes and start with their first logical block, so nodes of either
+ * kind are searched and split the same way.  The root holds two
+ * entries; when it is full its entries move to a new block and it
+ * becomes an index over that block, so the tree grows at the top.
+ *
+ * Lookups take i_ext_sem for reading, allocations for writing.  The
+ * root is also changed under ei->rwlock, since lab4fs_update_inode
+ * copies i_block under it.
+ */
+
+#define LAB4FS_EXT_ENTRY_SIZE   12
+#define LAB4FS_EXT_MAX_LEN      32768
+#define LAB4FS_EXT_MAX_DEPTH    5
+#define LAB4FS_EXT_NONE         0xffffffff
+
+struct lab4fs_ext_path {
+    struct lab4fs_extent_header *p_hdr;
+    struct buffer_head *p_bh;   /* NULL for the root */
+    int p_idx;                  /* entry followed, or the extent found */
+};
+
+static inline struct lab4fs_extent_header *ext_root(struct inode *inode)
+{
+    return (struct lab4fs_extent_header *)LAB4FS_I(inode)->i_block;
+}
+
+static inline void *ext_entry(struct lab4fs_extent_header *h, int i)
+{
+    return (char *)(h + 1) + i * LAB4FS_EXT_ENTRY_SIZE;
+}
+
+/* The first logical block of entry i, whatever its kind */
+static inline __u32 ext_key(struct lab4fs_extent_header *h, int i)
+{
+    return le32_to_cpu(*(__le32 *)ext_entry(h, i));
+}
+
+/* The root only gets the part of i_block kept in the on-disk i_block */
+static inline int ext_root_max(void)
+{
+    return ((LAB4FS_IND_BLOCK + 1) * sizeof(__le32) -
+            sizeof(struct lab4fs_extent_header)) / LAB4FS_EXT_ENTRY_SIZE;
+}
+
+static inline int ext_block_max(struct super_block *sb)
+{
+    return (sb->s_blocksize - sizeof(struct lab4fs_extent_header)) /
+        LAB4FS_EXT_ENTRY_SIZE;
+}
+
+void lab4fs_ext_tree_init(struct inode *inode)
+{
+    struct lab4fs_extent_header *h = ext_root(inode);
+
+    memset(LAB4FS_I(inode)->i_block, 0, sizeof(LAB4FS_I(inode)->i_block));
+    h->eh_magic = cpu_to_le16(LAB4FS_EXT_MAGIC);
+    h->eh_max = cpu_to_le16(ext_root_max());
+}
+
+static int ext_check(struct inode *inode, struct lab4fs_extent_header *h,
+        int depth, int max)
+{
+    if (le16_to_cpu(h->eh_magic) != LAB4FS_EXT_MAGIC ||
+            le16_to_cpu(h->eh_depth) != depth ||
+            le16_to_cpu(h->eh_max) != max ||
+            le16_to_cpu(h->eh_entries) > max) {
+        LAB4ERROR("bad extent node in inode %lu: magic %x, depth %u, "
+                "entries %u/%u\n", inode->i_ino, le16_to_cpu(h->eh_magic),
+                le16_to_cpu(h->eh_depth), le16_to_cpu(h->eh_entries),
+                le16_to_cpu(h->eh_max));
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Index of the last entry starting at or before iblock, -1 if none */
+static int ext_search(struct lab4fs_extent_header *h, __u32 iblock)
+{
+    int lo = 0, hi = le16_to_cpu(h->eh_entries) - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (ext_key(h, mid) <= iblock)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return hi;
+}
+
+static void ext_release(struct lab4fs_ext_path *path)
+{
+    int i;
+
+    for (i = 0; i <= LAB4FS_EXT_MAX_DEPTH; i++) {
+        brelse(path[i].p_bh);
+        path[i].p_bh = NULL;
+    }
+}
+
+/*
+ * Walk from the root down to the leaf that would hold iblock, one
+ * binary search per level.  Return the depth of the tree.
+ */
+static int ext_find(struct inode *inode, __u32 iblock,
+        struct lab4fs_ext_path *path)
+{
+    struct lab4fs_extent_header *h = ext_root(inode);
+    struct lab4fs_extent_idx *ix;
+    struct buffer_head *bh;
+    int depth = le16_to_cpu(h->eh_depth);
+    int l;
+
+    if (depth >= LAB4FS_EXT_MAX_DEPTH ||
+            ext_check(inode, h, depth, ext_root_max()))
+        return -EIO;
+    for (l = 0; ; l++) {
+        path[l].p_hdr = h;
+        path[l].p_idx = ext_search(h, iblock);
+        if (l == depth)
+            break;
+        if (path[l].p_idx < 0)
+            path[l].p_idx = 0;
+        ix = ext_entry(h, path[l].p_idx);
+        bh = sb_bread(inode->i_sb, le32_to_cpu(ix->ei_leaf));
+        if (!bh) {
+            LAB4ERROR("cannot read extent node %u of inode %lu\n",
+                    le32_to_cpu(ix->ei_leaf), inode->i_ino);
+            return -EIO;
+        }
+        path[l + 1].p_bh = bh;
+        h = (struct lab4fs_extent_header *)bh->b_data;
+        if (ext_check(inode, h, depth - l - 1, ext_block_max(inode->i_sb)))
+            return -EIO;
+    }
+    return depth;
+}
+
+/* The first mapped logical block after the leaf entry of path */
+static __u32 ext_next_allocated(struct lab4fs_ext_path *path, int depth)
+{
+    int l;
+
+    for (l = depth; l >= 0; l--)
+        if (path[l].p_idx + 1 < le16_to_cpu(path[l].p_hdr->eh_entries))
+            return ext_key(path[l].p_hdr, path[l].p_idx + 1);
+    return LAB4FS_EXT_NONE;
+}
+
+static void ext_dirty(struct inode *inode, struct lab4fs_ext_path *p)
+{
+    if (p->p_bh)
+        mark_buffer_dirty(p->p_bh);
+    else
+        mark_inode_dirty(inode);
+}
+
+/* A fresh, empty tree node at level depth */
+static struct buffer_head *ext_new_node(struct inode *inode, __u32 goal,
+        int depth, long *err)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *h;
+    struct buffer_head *bh;
+    __u32 block;
+
+    block = lab4fs_alloc_data_block(inode, goal, err);
+    if (*err)
+        return NULL;
+    bh = sb_getblk(inode->i_sb, block);
+    if (!bh) {
+        lab4fs_free_blocks(inode, block, 1);
+        *err = -EIO;
+        return NULL;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    h = (struct lab4fs_extent_header *)bh->b_data;
+    h->eh_magic = cpu_to_le16(LAB4FS_EXT_MAGIC);
+    h->eh_max = cpu_to_le16(ext_block_max(inode->i_sb));
+    h->eh_depth = cpu_to_le16(depth);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+
+    write_lock(&ei->rwlock);
+    inode->i_blocks++;
+    write_unlock(&ei->rwlock);
+    return bh;
+}
+
+/*
+ * Keep the index entries above level l no higher than the first key
+ * of the node they point to, after an entry went in at the front.
+ */
+static void ext_fix_index(struct inode *inode, struct lab4fs_ext_path *path,
+        int l)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_idx *ix;
+    __u32 key;
+
+    for (; l > 0; l--) {
+        key = ext_key(path[l].p_hdr, 0);
+        ix = ext_entry(path[l - 1].p_hdr, path[l - 1].p_idx);
+        if (le32_to_cpu(ix->ei_block) <= key)
+            break;
+        write_lock(&ei->rwlock);
+        ix->ei_block = cpu_to_le32(key);
+        write_unlock(&ei->rwlock);
+        ext_dirty(inode, &path[l - 1]);
+        if (path[l - 1].p_idx)
+            break;
+    }
+}
+
+/*
+ * The root is full: move its entries to a new block and make the root
+ * an index with that block as its only child.  path gets one level
+ * deeper.
+ */
+static int ext_grow(struct inode *inode, struct lab4fs_ext_path *path)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *root = ext_root(inode);
+    struct lab4fs_extent_header *h;
+    struct lab4fs_extent_idx *ix;
+    struct buffer_head *bh;
+    int depth = le16_to_cpu(root->eh_depth);
+    int n = le16_to_cpu(root->eh_entries);
+    long err = 0;
+
+    if (depth + 1 >= LAB4FS_EXT_MAX_DEPTH)
+        return -EFBIG;
+    bh = ext_new_node(inode, lab4fs_inode_goal(inode), depth, &err);
+    if (!bh)
+        return err;
+    h = (struct lab4fs_extent_header *)bh->b_data;
+    memcpy(ext_entry(h, 0), ext_entry(root, 0), n * LAB4FS_EXT_ENTRY_SIZE);
+    h->eh_entries = cpu_to_le16(n);
+
+    write_lock(&ei->rwlock);
+    memset(ext_entry(root, 0), 0, n * LAB4FS_EXT_ENTRY_SIZE);
+    root->eh_entries = cpu_to_le16(1);
+    root->eh_depth = cpu_to_le16(depth + 1);
+    ix = ext_entry(root, 0);
+    ix->ei_block = cpu_to_le32(n ? ext_key(h, 0) : 0);
+    ix->ei_leaf = cpu_to_le32(bh->b_blocknr);
+    write_unlock(&ei->rwlock);
+    mark_inode_dirty(inode);
+
+    memmove(path + 1, path, (depth + 1) * sizeof(*path));
+    path[1].p_hdr = h;
+    path[1].p_bh = bh;
+    path[0].p_hdr = root;
+    path[0].p_bh = NULL;
+    path[0].p_idx = 0;
+    return 0;
+}
+
+/*
+ * Put entry e at position pos of the node at level l of path.  A full
+ * node is split at pos, the entries after it going to a new node; an
+ * append therefore starts a new node and leaves the old one full, which
+ * is what sequential writes want.  The new node is then added to the
+ * level above the same way.
+ */
+static int ext_insert(struct inode *inode, struct lab4fs_ext_path *path,
+        int l, int pos, void *e)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *h = path[l].p_hdr, *nh;
+    struct lab4fs_extent_idx ix;
+    struct buffer_head *bh;
+    int n = le16_to_cpu(h->eh_entries);
+    int moved;
+    long err = 0;
+
+    if (n < le16_to_cpu(h->eh_max)) {
+        if (!path[l].p_bh)
+            write_lock(&ei->rwlock);
+        memmove(ext_entry(h, pos + 1), ext_entry(h, pos),
+                (n - pos) * LAB4FS_EXT_ENTRY_SIZE);
+        memcpy(ext_entry(h, pos), e, LAB4FS_EXT_ENTRY_SIZE);
+        h->eh_entries = cpu_to_le16(n + 1);
+        if (!path[l].p_bh)
+            write_unlock(&ei->rwlock);
+        ext_dirty(inode, &path[l]);
+        if (pos == 0)
+            ext_fix_index(inode, path, l);
+        return 0;
+    }
+
+    if (l == 0) {
+        err = ext_grow(inode, path);
+        if (err)
+            return err;
+        return ext_insert(inode, path, 1, pos, e);
+    }
+
+    bh = ext_new_node(inode, path[l].p_bh->b_blocknr + 1,
+            le16_to_cpu(h->eh_depth), &err);
+    if (!bh)
+        return err;
+    nh = (struct lab4fs_extent_header *)bh->b_data;
+    moved = n - pos;
+    if (moved) {
+        memcpy(ext_entry(nh, 0), ext_entry(h, pos),
+                moved * LAB4FS_EXT_ENTRY_SIZE);
+        nh->eh_entries = cpu_to_le16(moved);
+        h->eh_entries = cpu_to_le16(pos);
+        memcpy(ext_entry(h, pos), e, LAB4FS_EXT_ENTRY_SIZE);
+        h->eh_entries = cpu_to_le16(pos + 1);
+        mark_buffer_dirty(path[l].p_bh);
+        if (pos == 0)
+            ext_fix_index(inode, path, l);
+    } else {
+        memcpy(ext_entry(nh, 0), e, LAB4FS_EXT_ENTRY_SIZE);
+        nh->eh_entries = cpu_to_le16(1);
+    }
+    mark_buffer_dirty(bh);
+
+    ix.ei_block = cpu_to_le32(ext_key(nh, 0));
+    ix.ei_leaf = cpu_to_le32(bh->b_blocknr);
+    ix.ei_pad = 0;
+    brelse(bh);
+    return ext_insert(inode, path, l - 1, path[l - 1].p_idx + 1, &ix);
+}
+
+/* Read ahead the first node below the root, see lab4fs_readahead_indirect */
+void lab4fs_ext_readahead(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *h = ext_root(inode);
+    struct lab4fs_extent_idx *ix;
+    __u32 block = 0;
+
+    down_read(&ei->i_ext_sem);
+    if (le16_to_cpu(h->eh_depth) && le16_to_cpu(h->eh_entries)) {
+        ix = ext_entry(h, 0);
+        block = le32_to_cpu(ix->ei_leaf);
+    }
+    up_read(&ei->i_ext_sem);
+    if (block)
+        sb_breadahead(inode->i_sb, block);
+}
+
+/*
+ * get_block for extent mapped inodes.  want is how many blocks the
+ * caller is about to need from iblock on; the first maxblocks of them
+ * are mapped at once, and as for indirect mapping the others become
+ * the inode's preallocation, so the following calls extend the same
+ * extent.  Return how many blocks were mapped, 0 for a hole.
+ */
+int lab4fs_ext_get_block(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh_result, int create, int want, int maxblocks)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_ext_path path[LAB4FS_EXT_MAX_DEPTH + 1];
+    struct lab4fs_extent *ex = NULL, newex;
+    unsigned long count;
+    __u32 block, goal, next, start = 0, len = 0;
+    unsigned gen;
+    int depth, mapped = 0;
+    long err = 0;
+
+    if (iblock >= LAB4FS_EXT_NONE)
+        return -EIO;
+    if (maxblocks > LAB4FS_EXT_MAX_LEN)
+        maxblocks = LAB4FS_EXT_MAX_LEN;
+    memset(path, 0, sizeof(path));
+    if (create)
+        down_write(&ei->i_ext_sem);
+    else
+        down_read(&ei->i_ext_sem);
+    /* Blocks only leave the tree under i_ext_sem held for write */
+    gen = lab4fs_map_cache_gen(inode);
+
+    depth = ext_find(inode, iblock, path);
+    if (depth < 0) {
+        err = depth;
+        goto out;
+    }
+    if (path[depth].p_idx >= 0) {
+        ex = ext_entry(path[depth].p_hdr, path[depth].p_idx);
+        start = le32_to_cpu(ex->ee_block);
+        len = le16_to_cpu(ex->ee_len);
+        if (iblock < start + len) {
+            map_bh(bh_result, inode->i_sb,
+                    le32_to_cpu(ex->ee_start) + iblock - start);
+            mapped = min_t(__u32, maxblocks, start + len - iblock);
+            lab4fs_map_cache_set(inode, gen, start,
+                    le32_to_cpu(ex->ee_start), len);
+            goto out;
+        }
+    }
+    if (!create)
+        goto out;
+
+    next = ext_next_allocated(path, depth);
+    if (want < maxblocks)
+        want = maxblocks;
+    if (want > next - iblock)
+        want = next - iblock;
+    if (maxblocks > want)
+        maxblocks = want;
+    if (ex)
+        goal = le32_to_cpu(ex->ee_start) + iblock - start;
+    else
+        goal = lab4fs_inode_goal(inode);
+
+    block = lab4fs_use_prealloc(inode, goal);
+    if (block) {
+        mapped = 1;
+    } else {
+        lab4fs_discard_prealloc(inode);
+        count = want;
+        block = lab4fs_alloc_blocks(inode, goal, &count, &err);
+        if (err)
+            goto out;
+        mapped = min_t(unsigned long, maxblocks, count);
+        if (count > mapped) {
+            write_lock(&ei->rwlock);
+            ei->i_prealloc_block = block + mapped;
+            ei->i_prealloc_count = count - mapped;
+            write_unlock(&ei->rwlock);
+        }
+    }
+
+    if (ex && start + len == iblock &&
+            le32_to_cpu(ex->ee_start) + len == block &&
+            len + mapped <= LAB4FS_EXT_MAX_LEN) {
+        if (!path[depth].p_bh)
+            write_lock(&ei->rwlock);
+        ex->ee_len = cpu_to_le16(len + mapped);
+        if (!path[depth].p_bh)
+            write_unlock(&ei->rwlock);
+        ext_dirty(inode, &path[depth]);
+    } else {
+        newex.ee_block = cpu_to_le32(iblock);
+        newex.ee_start = cpu_to_le32(block);
+        newex.ee_len = cpu_to_le16(mapped);
+        newex.ee_pad = 0;
+        err = ext_insert(inode, path, depth, path[depth].p_idx + 1, &newex);
+        if (err) {
+            lab4fs_free_blocks(inode, block, mapped);
+            mapped = 0;
+            goto out;
+        }
+    }
+
+    write_lock(&ei->rwlock);
+    inode->i_blocks += mapped;
+    write_unlock(&ei->rwlock);
+    map_bh(bh_result, inode->i_sb, block);
+    set_buffer_new(bh_result);
+    lab4fs_map_cache_set(inode, gen, iblock, block, mapped);
+out:
+    ext_release(path);
+    if (create)
+        up_write(&ei->i_ext_sem);
+    else
+        up_read(&ei->i_ext_sem);
+    return err ? err : mapped;
+}
+
+/*
+ * How many tree nodes inserting an extent for iblock would allocate:
+ * one for each full node from the leaf up, the root growing the tree
+ * if it is full too.  *leaf is set to the first of the leaf's worth of
+ * blocks iblock belongs to, so that callers can reserve for each group
+ * of new extents once, see lab4fs_missing_meta.
+ */
+int lab4fs_ext_missing_meta(struct inode *inode, sector_t iblock,
+        sector_t *leaf)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_ext_path path[LAB4FS_EXT_MAX_DEPTH + 1];
+    int depth, l, missing = 0;
+
+    *leaf = iblock - iblock % ext_block_max(inode->i_sb);
+    if (iblock >= LAB4FS_EXT_NONE)
+        return 0;
+    memset(path, 0, sizeof(path));
+    down_read(&ei->i_ext_sem);
+    depth = ext_find(inode, iblock, path);
+    for (l = depth; l >= 0; l--) {
+        if (le16_to_cpu(path[l].p_hdr->eh_entries) <
+                le16_to_cpu(path[l].p_hdr->eh_max))
+            break;
+        missing++;
+    }
+    ext_release(path);
+    up_read(&ei->i_ext_sem);
+    return missing;
+}
+
+/*
+ * Take out of the node h, at level depth of the tree, what maps blocks
+ * from from on, handing the blocks to fb.  Nodes left empty are freed
+ * too.  Return how many entries h keeps.
+ */
+static int ext_truncate_node(struct inode *inode,
+        struct lab4fs_extent_header *h, struct buffer_head *bh, int depth,
+        __u32 from, struct lab4fs_free_batch *fb)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *ch;
+    struct lab4fs_extent_idx *ix;
+    struct lab4fs_extent *ex;
+    struct buffer_head *cbh;
+    int n = le16_to_cpu(h->eh_entries);
+    int i = ext_search(h, from), keep;
+    __u32 start, len, leaf;
+
+    if (i < 0)
+        i = 0;
+    keep = i;
+    if (!depth) {
+        for (; i < n; i++) {
+            ex = ext_entry(h, i);
+            start = le32_to_cpu(ex->ee_block);
+            len = le16_to_cpu(ex->ee_len);
+            if (start + len <= from) {
+                keep = i + 1;
+                continue;
+            }
+            if (start >= from) {
+                lab4fs_free_batch_add(fb, le32_to_cpu(ex->ee_start), len);
+                continue;
+            }
+            lab4fs_free_batch_add(fb,
+                    le32_to_cpu(ex->ee_start) + from - start,
+                    start + len - from);
+            if (!bh)
+                write_lock(&ei->rwlock);
+            ex->ee_len = cpu_to_le16(from - start);
+            if (!bh)
+                write_unlock(&ei->rwlock);
+            keep = i + 1;
+        }
+        goto out;
+    }
+
+    for (; i < n; i++) {
+        ix = ext_entry(h, i);
+        leaf = le32_to_cpu(ix->ei_leaf);
+        cbh = sb_bread(inode->i_sb, leaf);
+        if (!cbh) {
+            LAB4ERROR("cannot read extent node %u of inode %lu\n",
+                    leaf, inode->i_ino);
+            keep = i + 1;
+            continue;
+        }
+        ch = (struct lab4fs_extent_header *)cbh->b_data;
+        if (ext_check(inode, ch, depth - 1, ext_block_max(inode->i_sb)) ||
+                ext_truncate_node(inode, ch, cbh, depth - 1, from, fb)) {
+            brelse(cbh);
+            keep = i + 1;
+            continue;
+        }
+        bforget(cbh);
+        lab4fs_free_batch_add(fb, leaf, 1);
+    }
+
+out:
+    if (keep < n) {
+        if (!bh)
+            write_lock(&ei->rwlock);
+        memset(ext_entry(h, keep), 0, (n - keep) * LAB4FS_EXT_ENTRY_SIZE);
+        h->eh_entries = cpu_to_le16(keep);
+        if (!bh)
+            write_unlock(&ei->rwlock);
+    }
+    if (bh)
+        mark_buffer_dirty(bh);
+    return keep;
+}
+
+/*
+ * Free the blocks an extent mapped inode has from from on, see
+ * lab4fs_truncate.  A tree left empty goes back to a bare root.
+ */
+void lab4fs_ext_truncate(struct inode *inode, __u32 from,
+        struct lab4fs_free_batch *fb)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_extent_header *h = ext_root(inode);
+    int depth;
+
+    down_write(&ei->i_ext_sem);
+    /* Nothing may be cached past from while its blocks are freed */
+    lab4fs_map_cache_invalidate(inode);
+    depth = le16_to_cpu(h->eh_depth);
+    if (depth >= LAB4FS_EXT_MAX_DEPTH ||
+            ext_check(inode, h, depth, ext_root_max()))
+        goto out;
+    if (!ext_truncate_node(inode, h, NULL, depth, from, fb) && depth) {
+        write_lock(&ei->rwlock);
+        lab4fs_ext_tree_init(inode);
+        write_unlock(&ei->rwlock);
+    }
+    mark_inode_dirty(inode);
+out:
+    up_write(&ei->i_ext_sem);
+}
@@ -1,6 +1,35 @@
 #include "lab4fs.h"
 
+/*
+ * A reader is likely to go past the direct blocks soon, so get the
+ * indirect block on its way now.
+ */
+static int lab4fs_open_file(struct inode *inode, struct file *filp)
+{
+    int err = generic_file_open(inode, filp);
+
+    if (!err && (filp->f_mode & FMODE_READ))
+        lab4fs_readahead_indirect(inode);
+    return err;
+}
+
+/*
+ * Called when the last reference to an open file is gone. The last
+ * writer hands the preallocated blocks and reservation window back so
+ * the space is usable by others.
+ */
+static int lab4fs_release_file(struct inode *inode, struct file *filp)
+{
+    if ((filp->f_mode & FMODE_WRITE) &&
+            atomic_read(&inode->i_writecount) == 1) {
+        lab4fs_discard_prealloc(inode);
+        lab4fs_discard_reservation(inode);
+    }
+    return 0;
+}
+
 struct inode_operations lab4fs_file_inode_operations = {
+    .truncate   = lab4fs_truncate,
     .setattr    = lab4fs_setattr,
 	.permission	= lab4fs_permission,
 };
@@ -12,7 +41,8 @@ struct file_operations lab4fs_file_operations = {
 	.aio_read	= generic_file_aio_read,
 	.aio_write	= generic_file_aio_write,
 	.mmap		= generic_file_mmap,
-	.open		= generic_file_open,
+	.open		= lab4fs_open_file,
+	.release	= lab4fs_release_file,
 	.readv		= generic_file_readv,
 	.writev		= generic_file_writev,
 	.sendfile	= generic_file_sendfile,
@@ -0,0 +1,27 @@
+/*
+ * linux/fs/lab4fs/hash.c
+ *
+ * Name hash of the directory index, LAB4FS_HASH_VERSION 1.
+ */
+
+#include "lab4fs.h"
+
+/*
+ * FNV-1a over the name, then a final mix so that names differing only
+ * in their last bytes still spread over the whole range.
+ */
+__u32 lab4fs_dirhash(const char *name, int len)
+{
+    __u32 hash = 2166136261U;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
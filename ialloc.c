@@ -0,0 +1,298 @@
+#include "lab4fs.h"
+
+/*
+ * Inode number allocation.
+ *
+ * A new file gets an inode close to its directory's, in the same inode
+ * table block when there is room, so scanning a directory only reads a
+ * handful of inode table blocks.  New directories are spread over the
+ * groups instead, so that each one has room for its files nearby; this
+ * is a simplified version of the Orlov allocator of ext2.
+ */
+
+static inline int group_free_inodes(struct lab4fs_sb_info *sbi, int group)
+{
+    return sbi->s_inode_bitmap.blocks[group].nr_free;
+}
+
+static inline int group_free_blocks(struct lab4fs_sb_info *sbi, int group)
+{
+    return sbi->s_data_bitmap.blocks[group].nr_free;
+}
+
+static inline int group_dirs(struct super_block *sb, int group)
+{
+    struct lab4fs_group_desc *gdp = lab4fs_get_group_desc(sb, group, NULL);
+    return gdp ? le16_to_cpu(gdp->bg_used_dirs_count) : 0;
+}
+
+static void lab4fs_group_dirs_add(struct super_block *sb, ino_t ino,
+        int delta)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_group_desc *gdp;
+    struct buffer_head *bh;
+
+    if (sbi->s_group_desc == NULL)
+        return;
+    gdp = lab4fs_get_group_desc(sb, ino / sbi->s_inodes_per_group, &bh);
+    if (!gdp)
+        return;
+    spin_lock(&sbi->s_group_lock);
+    gdp->bg_used_dirs_count =
+        cpu_to_le16(le16_to_cpu(gdp->bg_used_dirs_count) + delta);
+    spin_unlock(&sbi->s_group_lock);
+    mark_buffer_dirty(bh);
+}
+
+/*
+ * Pick the group of a new directory.  Top level directories go to the
+ * group with the fewest directories among those with at least the
+ * average free inodes and blocks, looking from a random group on.
+ * Deeper ones stay with their parent unless its group is getting
+ * crowded with directories or short on space.
+ */
+static int lab4fs_find_group_dir(struct super_block *sb, struct inode *parent)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    int ngroups = sbi->s_groups_count;
+    int parent_group = parent->i_ino / sbi->s_inodes_per_group;
+    int avefreei, avefreeb, ndirs, max_dirs, min_inodes, min_blocks;
+    int best = -1, best_ndir = 0;
+    int i, group;
+    unsigned int start;
+
+    if (ngroups == 1)
+        return 0;
+
+    avefreei = percpu_counter_read_positive(&sbi->s_free_inodes_counter) /
+        ngroups;
+    avefreeb = percpu_counter_read_positive(&sbi->s_free_data_blocks_counter)
+        / ngroups;
+
+    if (parent->i_ino == sbi->s_root_inode) {
+        get_random_bytes(&start, sizeof(start));
+        for (i = 0; i < ngroups; i++) {
+            group = (start + i) % ngroups;
+            if (group_free_inodes(sbi, group) < avefreei ||
+                    group_free_blocks(sbi, group) < avefreeb)
+                continue;
+            ndirs = group_dirs(sb, group);
+            if (best < 0 || ndirs < best_ndir) {
+                best = group;
+                best_ndir = ndirs;
+            }
+        }
+        if (best >= 0)
+            return best;
+        goto fallback;
+    }
+
+    for (ndirs = 0, i = 0; i < ngroups; i++)
+        ndirs += group_dirs(sb, i);
+    max_dirs = ndirs / ngroups + sbi->s_inodes_per_group / 16;
+    min_inodes = avefreei - sbi->s_inodes_per_group / 4;
+    min_blocks = avefreeb - sbi->s_blocks_per_group / 4;
+    for (i = 0; i < ngroups; i++) {
+        group = (parent_group + i) % ngroups;
+        if (group_dirs(sb, group) >= max_dirs ||
+                group_free_inodes(sbi, group) < min_inodes ||
+                group_free_blocks(sbi, group) < min_blocks)
+            continue;
+        return group;
+    }
+
+fallback:
+    for (i = 0; i < ngroups; i++) {
+        group = (parent_group + i) % ngroups;
+        if (group_free_inodes(sbi, group) >= avefreei)
+            return group;
+    }
+    return parent_group;
+}
+
+/*
+ * Per-CPU batches.
+ *
+ * Creating files in parallel would have every CPU search and lock the
+ * same inode bitmap block for every file.  Instead each CPU claims up to
+ * LAB4FS_INO_BATCH consecutive free inode numbers for one group at a
+ * time, and hands them out to the new files of that group under its own
+ * lock.  Claimed numbers count as used until they are given back, which
+ * happens on unmount or when no free inode is left elsewhere.
+ */
+
+int lab4fs_init_ino_batches(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_ino_batch *batch;
+    int cpu;
+
+    sbi->s_ino_batch = alloc_percpu(struct lab4fs_ino_batch);
+    if (!sbi->s_ino_batch)
+        return -ENOMEM;
+    for_each_cpu(cpu) {
+        batch = per_cpu_ptr(sbi->s_ino_batch, cpu);
+        spin_lock_init(&batch->lock);
+        batch->group = -1;
+        batch->next = batch->nr = 0;
+    }
+    return 0;
+}
+
+/* Give back whatever is left in the batch of every CPU */
+static void lab4fs_drain_ino_batches(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_ino_batch *batch;
+    __u32 ino[LAB4FS_INO_BATCH];
+    int cpu, i, n;
+
+    for_each_cpu(cpu) {
+        batch = per_cpu_ptr(sbi->s_ino_batch, cpu);
+        spin_lock(&batch->lock);
+        n = batch->nr - batch->next;
+        memcpy(ino, batch->ino + batch->next, n * sizeof(__u32));
+        batch->next = batch->nr = 0;
+        batch->group = -1;
+        spin_unlock(&batch->lock);
+        for (i = 0; i < n; i++)
+            lab4fs_free_ino(sb, ino[i], 0);
+    }
+}
+
+void lab4fs_destroy_ino_batches(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+
+    if (!sbi->s_ino_batch)
+        return;
+    lab4fs_drain_ino_batches(sb);
+    free_percpu(sbi->s_ino_batch);
+    sbi->s_ino_batch = NULL;
+}
+
+/* Take the next number of this CPU's batch if it serves group */
+static ino_t lab4fs_batch_get(struct lab4fs_sb_info *sbi, int group)
+{
+    struct lab4fs_ino_batch *batch;
+    ino_t ino = 0;
+
+    batch = per_cpu_ptr(sbi->s_ino_batch, get_cpu());
+    spin_lock(&batch->lock);
+    if (batch->group == group && batch->next < batch->nr)
+        ino = batch->ino[batch->next++];
+    spin_unlock(&batch->lock);
+    put_cpu();
+    return ino;
+}
+
+/*
+ * Make the n numbers in ino this CPU's batch for group.  The numbers
+ * the batch held before are given back.
+ */
+static void lab4fs_batch_put(struct super_block *sb, int group,
+        __u32 *ino, int n)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_ino_batch *batch;
+    __u32 old[LAB4FS_INO_BATCH];
+    int i, nr_old;
+
+    batch = per_cpu_ptr(sbi->s_ino_batch, get_cpu());
+    spin_lock(&batch->lock);
+    nr_old = batch->nr - batch->next;
+    memcpy(old, batch->ino + batch->next, nr_old * sizeof(__u32));
+    memcpy(batch->ino, ino, n * sizeof(__u32));
+    batch->group = group;
+    batch->next = 0;
+    batch->nr = n;
+    spin_unlock(&batch->lock);
+    put_cpu();
+    for (i = 0; i < nr_old; i++)
+        lab4fs_free_ino(sb, old[i], 0);
+}
+
+/*
+ * Claim up to max consecutive free inode numbers, the first one at or
+ * after start if possible, anywhere otherwise.  Return how many.
+ */
+static int lab4fs_claim_inos(struct super_block *sb, __u32 start, int max,
+        __u32 *ino)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_bitmap *bitmap = &sbi->s_inode_bitmap;
+    __u32 first;
+    int i, n;
+
+    if (!lab4fs_counter_positive(&sbi->s_free_inodes_counter))
+        return 0;
+    n = bitmap_claim_zero_run(bitmap, start, bitmap->nr_valid_bits, max,
+            &first);
+    if (!n && start > sbi->s_first_ino)
+        n = bitmap_claim_zero_run(bitmap, sbi->s_first_ino, start, max,
+                &first);
+    if (!n)
+        return 0;
+    for (i = 0; i < n; i++)
+        ino[i] = first + i;
+    percpu_counter_mod(&sbi->s_free_inodes_counter, -n);
+    sb->s_dirt = 1;
+    return n;
+}
+
+/*
+ * Claim an inode number for a new inode of the given mode under dir.
+ * Return 0 if there is none left.
+ */
+ino_t lab4fs_alloc_ino(struct inode *dir, int mode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    __u32 start, ino[LAB4FS_INO_BATCH];
+    int group, n, retried = 0;
+
+    if (S_ISDIR(mode)) {
+        group = lab4fs_find_group_dir(sb, dir);
+        start = group * sbi->s_inodes_per_group;
+    } else {
+        group = dir->i_ino / sbi->s_inodes_per_group;
+        if ((ino[0] = lab4fs_batch_get(sbi, group)) != 0)
+            return ino[0];
+        /* The first inode of the parent's inode table block */
+        start = dir->i_ino & ~(sbi->s_inodes_per_block - 1);
+    }
+    if (start < sbi->s_first_ino)
+        start = sbi->s_first_ino;
+
+retry:
+    n = lab4fs_claim_inos(sb, start, S_ISDIR(mode) ? 1 : LAB4FS_INO_BATCH,
+            ino);
+    if (!n) {
+        if (retried++)
+            return 0;
+        /* What is left may all be sitting in batches */
+        lab4fs_drain_ino_batches(sb);
+        goto retry;
+    }
+
+    if (S_ISDIR(mode))
+        lab4fs_group_dirs_add(sb, ino[0], 1);
+    else if (n > 1)
+        lab4fs_batch_put(sb, group, ino + 1, n - 1);
+    return ino[0];
+}
+
+/* Give inode number ino back */
+void lab4fs_free_ino(struct super_block *sb, ino_t ino, int mode)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+
+    /* 0 if the bit was clear already, -1 if it could not be read */
+    if (bitmap_test_and_clear_bit(&sbi->s_inode_bitmap, ino) <= 0)
+        return;
+    percpu_counter_inc(&sbi->s_free_inodes_counter);
+    if (S_ISDIR(mode))
+        lab4fs_group_dirs_add(sb, ino, -1);
+    sb->s_dirt = 1;
+}
@@ -0,0 +1,659 @@
+/*
+ * linux/fs/lab4fs/index.c
+ *
+ * Hashed directory index, after the ext3 htree; see struct
+ * lab4fs_dx_root_info for the layout.  A lookup or an insert reads the
+ * root, at most one node and one leaf, whatever the size of the
+ * directory.  Names with the same hash always share a leaf, so a lookup
+ * never goes on to the next one.
+ *
+ * Directories change under i_sem, which lookups hold as well.
+ */
+
+#include "lab4fs.h"
+
+#define DX_ROOT_INFO    24  /* after "." and ".." */
+#define DX_ROOT_ENTRIES 32
+#define DX_NODE_ENTRIES 8   /* after the unused record */
+
+struct dx_frame {
+    struct page *page;
+    char *block;                    /* in page */
+    struct lab4fs_dx_entry *entries;
+    struct lab4fs_dx_entry *at;     /* the entry followed down */
+};
+
+/* A name of a block being split or rebuilt */
+struct dx_map {
+    __u32 hash;
+    unsigned offs;
+    unsigned size;
+};
+
+static inline struct lab4fs_dx_countlimit *
+dx_cl(struct lab4fs_dx_entry *entries)
+{
+    return (struct lab4fs_dx_countlimit *)entries;
+}
+
+static inline unsigned dx_get_count(struct lab4fs_dx_entry *entries)
+{
+    return le16_to_cpu(dx_cl(entries)->count);
+}
+
+static inline unsigned dx_get_limit(struct lab4fs_dx_entry *entries)
+{
+    return le16_to_cpu(dx_cl(entries)->limit);
+}
+
+static inline void dx_set_count(struct lab4fs_dx_entry *entries, unsigned n)
+{
+    dx_cl(entries)->count = cpu_to_le16(n);
+}
+
+static inline void dx_set_limit(struct lab4fs_dx_entry *entries, unsigned n)
+{
+    dx_cl(entries)->limit = cpu_to_le16(n);
+}
+
+static inline __u32 dx_get_hash(struct lab4fs_dx_entry *entry)
+{
+    return le32_to_cpu(entry->hash);
+}
+
+static inline unsigned long dx_get_block(struct lab4fs_dx_entry *entry)
+{
+    return le32_to_cpu(entry->block);
+}
+
+static inline unsigned dx_root_limit(struct inode *dir)
+{
+    return (dir->i_sb->s_blocksize - DX_ROOT_ENTRIES) /
+        sizeof(struct lab4fs_dx_entry);
+}
+
+static inline unsigned dx_node_limit(struct inode *dir)
+{
+    return (dir->i_sb->s_blocksize - DX_NODE_ENTRIES) /
+        sizeof(struct lab4fs_dx_entry);
+}
+
+/* Block b of dir, mapped with its page in *page; NULL on error */
+static char *dx_bread(struct inode *dir, unsigned long b, struct page **page)
+{
+    int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+
+    *page = lab4fs_get_page(dir, b >> shift);
+    if (IS_ERR(*page)) {
+        LAB4ERROR("cannot read block %lu of directory #%lu\n", b,
+                dir->i_ino);
+        return NULL;
+    }
+    return (char *)page_address(*page) +
+        ((b & ((1 << shift) - 1)) << dir->i_blkbits);
+}
+
+/* Like dx_bread, for a block an index entry points to */
+static char *dx_bread_entry(struct inode *dir, struct lab4fs_dx_entry *entry,
+        struct page **page)
+{
+    unsigned long b = dx_get_block(entry);
+
+    if (!b || b >= dir->i_size >> dir->i_blkbits) {
+        LAB4ERROR("bad index entry to block %lu in directory #%lu\n", b,
+                dir->i_ino);
+        return NULL;
+    }
+    return dx_bread(dir, b, page);
+}
+
+/* Changes to the block of frame go between these two */
+static int dx_begin_change(struct inode *dir, struct dx_frame *frame)
+{
+    unsigned from = frame->block - (char *)page_address(frame->page);
+    int err;
+
+    lock_page(frame->page);
+    err = frame->page->mapping->a_ops->prepare_write(NULL, frame->page,
+            from, from + dir->i_sb->s_blocksize);
+    if (err)
+        unlock_page(frame->page);
+    return err;
+}
+
+static int dx_end_change(struct inode *dir, struct dx_frame *frame)
+{
+    unsigned from = frame->block - (char *)page_address(frame->page);
+
+    return lab4fs_commit_chunk(frame->page, from,
+            from + dir->i_sb->s_blocksize);
+}
+
+static void dx_release(struct dx_frame *frames, int n)
+{
+    while (n--)
+        lab4fs_put_page(frames[n].page);
+}
+
+/*
+ * Walk the index down to the leaf for hash, filling frames from the
+ * root on.  Return how many frames were used, each holding its page.
+ */
+static int dx_probe(struct inode *dir, __u32 hash, struct dx_frame *frames)
+{
+    struct dx_frame *frame = frames;
+    struct lab4fs_dx_root_info *info;
+    struct lab4fs_dx_entry *entries, *p, *q, *m;
+    struct page *page;
+    unsigned count, limit;
+    char *block;
+    int levels;
+
+    block = dx_bread(dir, 0, &page);
+    if (!block)
+        return -EIO;
+    info = (struct lab4fs_dx_root_info *)(block + DX_ROOT_INFO);
+    if (info->reserved_zero || info->hash_version != LAB4FS_HASH_VERSION ||
+            info->info_length != sizeof(*info) || info->indirect_levels > 1) {
+        LAB4ERROR("bad index root in directory #%lu\n", dir->i_ino);
+        lab4fs_put_page(page);
+        return -EIO;
+    }
+    levels = info->indirect_levels;
+    entries = (struct lab4fs_dx_entry *)(block + DX_ROOT_ENTRIES);
+    limit = dx_root_limit(dir);
+    for (;;) {
+        count = dx_get_count(entries);
+        if (!count || count > limit || dx_get_limit(entries) != limit) {
+            LAB4ERROR("bad index count in directory #%lu\n", dir->i_ino);
+            lab4fs_put_page(page);
+            goto fail;
+        }
+        /* The last entry whose hash is not above hash; the first has none */
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (dx_get_hash(m) > hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+        frame->page = page;
+        frame->block = block;
+        frame->entries = entries;
+        frame->at = p - 1;
+        if (!levels--)
+            return frame - frames + 1;
+        block = dx_bread_entry(dir, frame->at, &page);
+        frame++;
+        if (!block)
+            goto fail;
+        entries = (struct lab4fs_dx_entry *)(block + DX_NODE_ENTRIES);
+        limit = dx_node_limit(dir);
+    }
+fail:
+    dx_release(frames, frame - frames);
+    return -EIO;
+}
+
+/* Note the names of a directory block in map, return how many */
+static int dx_map_block(char *block, unsigned bs, struct dx_map *map)
+{
+    struct lab4fs_dir_entry *de = (struct lab4fs_dir_entry *)block;
+    int count = 0;
+
+    while ((char *)de < block + bs) {
+        if (de->inode) {
+            map[count].hash = lab4fs_dirhash(de->name, de->name_len);
+            map[count].offs = (char *)de - block;
+            map[count].size = LAB4FS_DIR_REC_LEN(de->name_len);
+            count++;
+        }
+        de = lab4fs_next_entry(de);
+    }
+    return count;
+}
+
+static void dx_sort_map(struct dx_map *map, int count)
+{
+    struct dx_map tmp;
+    int i, j;
+
+    for (i = 1; i < count; i++) {
+        tmp = map[i];
+        for (j = i; j > 0 && map[j - 1].hash > tmp.hash; j--)
+            map[j] = map[j - 1];
+        map[j] = tmp;
+    }
+}
+
+/*
+ * Fill buf with a directory block holding the count names of map, found
+ * at src, one after the other; the last record takes the rest.
+ */
+static void dx_pack(char *buf, char *src, struct dx_map *map, int count,
+        unsigned bs)
+{
+    struct lab4fs_dir_entry *de = (struct lab4fs_dir_entry *)buf;
+    char *p = buf;
+    int i;
+
+    memset(buf, 0, bs);
+    for (i = 0; i < count; i++) {
+        memcpy(p, src + map[i].offs, map[i].size);
+        de = (struct lab4fs_dir_entry *)p;
+        de->rec_len = cpu_to_le16(map[i].size);
+        p += map[i].size;
+    }
+    de->rec_len = cpu_to_le16(buf + bs - (char *)de);
+}
+
+/*
+ * Where to split the sorted names of map so that no hash ends up on
+ * both sides: as near the middle as possible, -1 if there is no way.
+ */
+static int dx_split_point(struct dx_map *map, int count)
+{
+    int i;
+
+    if (count < 2)
+        return -1;
+    for (i = count / 2; i < count; i++)
+        if (map[i].hash != map[i - 1].hash)
+            return i;
+    for (i = count / 2; i > 0; i--)
+        if (map[i].hash != map[i - 1].hash)
+            return i;
+    return -1;
+}
+
+/* Add an entry for block after the one frame followed */
+static int dx_insert(struct inode *dir, struct dx_frame *frame, __u32 hash,
+        unsigned long block)
+{
+    struct lab4fs_dx_entry *entries = frame->entries;
+    struct lab4fs_dx_entry *new = frame->at + 1;
+    unsigned count = dx_get_count(entries);
+    int err;
+
+    err = dx_begin_change(dir, frame);
+    if (err)
+        return err;
+    memmove(new + 1, new, (char *)(entries + count) - (char *)new);
+    new->hash = cpu_to_le32(hash);
+    new->block = cpu_to_le32(block);
+    dx_set_count(entries, count + 1);
+    return dx_end_change(dir, frame);
+}
+
+/*
+ * Make room in the full array of the last of the n frames: a full root
+ * gets a level of nodes below it, a full node is split in two.
+ */
+static int dx_grow(struct inode *dir, struct dx_frame *frames, int n)
+{
+    unsigned bs = dir->i_sb->s_blocksize;
+    unsigned long newblock = dir->i_size >> dir->i_blkbits;
+    struct dx_frame *frame = frames + n - 1;
+    struct lab4fs_dx_entry *entries = frame->entries, *nentries;
+    struct lab4fs_dir_entry *de;
+    unsigned count = dx_get_count(entries), split;
+    char *buf;
+    int err;
+
+    if (n > 1 && dx_get_count(frames->entries) >=
+            dx_get_limit(frames->entries)) {
+        LAB4ERROR("index of directory #%lu is full\n", dir->i_ino);
+        return -ENOSPC;
+    }
+    buf = kmalloc(bs, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    memset(buf, 0, bs);
+    de = (struct lab4fs_dir_entry *)buf;
+    de->rec_len = cpu_to_le16(bs);
+    nentries = (struct lab4fs_dx_entry *)(buf + DX_NODE_ENTRIES);
+
+    if (n == 1) {
+        memcpy(nentries, entries, count * sizeof(*entries));
+        dx_set_limit(nentries, dx_node_limit(dir));
+        err = lab4fs_write_dir_block(dir, newblock, buf);
+        if (err)
+            goto out;
+        err = dx_begin_change(dir, frame);
+        if (err)
+            goto out;
+        dx_set_count(entries, 1);
+        entries->block = cpu_to_le32(newblock);
+        ((struct lab4fs_dx_root_info *)(frame->block + DX_ROOT_INFO))->
+            indirect_levels = 1;
+        err = dx_end_change(dir, frame);
+        goto out;
+    }
+
+    split = count / 2;
+    memcpy(nentries, entries + split, (count - split) * sizeof(*entries));
+    dx_set_limit(nentries, dx_node_limit(dir));
+    dx_set_count(nentries, count - split);
+    err = lab4fs_write_dir_block(dir, newblock, buf);
+    if (!err)
+        err = dx_insert(dir, frames, dx_get_hash(entries + split), newblock);
+    if (!err)
+        err = dx_begin_change(dir, frame);
+    if (!err) {
+        dx_set_count(entries, split);
+        err = dx_end_change(dir, frame);
+    }
+out:
+    kfree(buf);
+    return err;
+}
+
+/*
+ * Split the full leaf block of the last of the n frames: the upper half
+ * of its names, by hash, go to a new block at the end of dir.  If the
+ * index has no room for one more leaf it grows instead.  Either way the
+ * caller has to walk it again.
+ */
+static int dx_split_leaf(struct inode *dir, struct dx_frame *frames, int n,
+        char *block)
+{
+    unsigned bs = dir->i_sb->s_blocksize;
+    unsigned long newblock = dir->i_size >> dir->i_blkbits;
+    struct dx_frame *frame = frames + n - 1;
+    unsigned long leaf = dx_get_block(frame->at);
+    struct dx_map *map;
+    char *buf;
+    int count, split, err = -ENOMEM;
+
+    if (dx_get_count(frame->entries) >= dx_get_limit(frame->entries))
+        return dx_grow(dir, frames, n);
+
+    map = kmalloc(bs / LAB4FS_DIR_REC_LEN(1) * sizeof(*map), GFP_KERNEL);
+    buf = kmalloc(2 * bs, GFP_KERNEL);
+    if (!map || !buf)
+        goto out;
+    count = dx_map_block(block, bs, map);
+    dx_sort_map(map, count);
+    split = dx_split_point(map, count);
+    if (split < 0) {
+        LAB4ERROR("too many names with one hash in directory #%lu\n",
+                dir->i_ino);
+        err = -ENOSPC;
+        goto out;
+    }
+    dx_pack(buf, block, map, split, bs);
+    dx_pack(buf + bs, block, map + split, count - split, bs);
+
+    err = lab4fs_write_dir_block(dir, newblock, buf + bs);
+    if (!err)
+        err = dx_insert(dir, frame, map[split].hash, newblock);
+    if (!err)
+        err = lab4fs_write_dir_block(dir, leaf, buf);
+out:
+    kfree(map);
+    kfree(buf);
+    return err;
+}
+
+/*
+ * lab4fs_find_entry for an indexed directory.  A return of 0 with
+ * *res_dir NULL means there is no such name; an error means the index
+ * is no good and the caller should scan.
+ */
+int lab4fs_dx_find_entry(struct inode *dir, const char *name, int namelen,
+        struct lab4fs_dir_entry **res_dir, struct page **res_page)
+{
+    struct lab4fs_name_key key = lab4fs_name_key(dir, name, namelen);
+    struct dx_frame frames[2];
+    struct lab4fs_dir_entry *de;
+    struct page *page;
+    char *block, *limit;
+    int n;
+
+    *res_dir = NULL;
+    n = dx_probe(dir, lab4fs_dirhash(name, namelen), frames);
+    if (n < 0)
+        return n;
+    block = dx_bread_entry(dir, frames[n - 1].at, &page);
+    dx_release(frames, n);
+    if (!block)
+        return -EIO;
+
+    de = (struct lab4fs_dir_entry *)block;
+    limit = block + dir->i_sb->s_blocksize - LAB4FS_DIR_REC_LEN(namelen);
+    while ((char *)de <= limit) {
+        if (de->rec_len == 0) {
+            LAB4ERROR("zero-length dir entry\n");
+            lab4fs_put_page(page);
+            return -EIO;
+        }
+        if (lab4fs_match_key(key, namelen, name, de)) {
+            *res_dir = de;
+            *res_page = page;
+            return 0;
+        }
+        de = lab4fs_next_entry(de);
+    }
+    lab4fs_put_page(page);
+    return 0;
+}
+
+/* lab4fs_add_link for an indexed directory */
+int lab4fs_dx_add_link(struct dentry *dentry, struct inode *inode)
+{
+    struct inode *dir = dentry->d_parent->d_inode;
+	const char *name = dentry->d_name.name;
+	int namelen = dentry->d_name.len;
+    unsigned reclen = LAB4FS_DIR_REC_LEN(namelen);
+    __u32 hash = lab4fs_dirhash(name, namelen);
+    struct lab4fs_name_key key = lab4fs_name_key(dir, name, namelen);
+    struct dx_frame frames[2];
+    struct lab4fs_dir_entry *de, *slot;
+    struct page *page;
+    char *block, *end;
+    unsigned rec_len;
+    int n, err;
+
+again:
+    n = dx_probe(dir, hash, frames);
+    if (n < 0)
+        return n;
+    block = dx_bread_entry(dir, frames[n - 1].at, &page);
+    err = -EIO;
+    if (!block)
+        goto out;
+
+    /* The whole leaf is looked at, the name may be past a free slot */
+    slot = NULL;
+    end = block + dir->i_sb->s_blocksize;
+    for (de = (struct lab4fs_dir_entry *)block; (char *)de < end;
+            de = lab4fs_next_entry(de)) {
+        rec_len = le16_to_cpu(de->rec_len);
+        if (rec_len < LAB4FS_DIR_REC_LEN(1) || (char *)de + rec_len > end) {
+            LAB4ERROR("bad dir entry in directory #%lu\n", dir->i_ino);
+            err = -EIO;
+            goto out_page;
+        }
+        err = -EEXIST;
+        if (lab4fs_match_key(key, namelen, name, de))
+            goto out_page;
+        if (slot)
+            continue;
+        if (!de->inode && rec_len >= reclen)
+            slot = de;
+        else if (de->inode &&
+                rec_len >= LAB4FS_DIR_REC_LEN(de->name_len) + reclen)
+            slot = de;
+    }
+    if (slot) {
+        lock_page(page);
+        err = lab4fs_insert_entry(page, slot, name, namelen, inode);
+        goto out_page;
+    }
+
+    err = dx_split_leaf(dir, frames, n, block);
+    lab4fs_put_page(page);
+    dx_release(frames, n);
+    if (err)
+        return err;
+    goto again;
+
+out_page:
+    lab4fs_put_page(page);
+out:
+    dx_release(frames, n);
+    return err;
+}
+
+/*
+ * Index dir: "." and ".." go with a new root in block 0, the other names
+ * sorted by hash into the blocks after it, and blocks left over are
+ * emptied.  A directory bigger than LAB4FS_DX_BUILD_BLOCKS, or whose names
+ * cannot be cut into leaves, stays linear.
+ */
+int lab4fs_dx_build(struct inode *dir)
+{
+    unsigned bs = dir->i_sb->s_blocksize;
+    unsigned long nblocks = (dir->i_size + bs - 1) >> dir->i_blkbits;
+    unsigned long npages = (dir->i_size + PAGE_CACHE_SIZE - 1) >>
+        PAGE_CACHE_SHIFT;
+    struct lab4fs_dx_root_info *info;
+    struct lab4fs_dx_entry *entries;
+    struct lab4fs_dir_entry *de;
+    struct dx_map *map = NULL;
+    char *pool = NULL, *buf = NULL;
+    unsigned *bound = NULL;
+    __le32 parent = cpu_to_le32(dir->i_ino);
+    unsigned long n, b;
+    unsigned used = 0, size;
+    int count = 0, nleaves = 0, i, j, err = -ENOMEM;
+
+    if (nblocks > LAB4FS_DX_BUILD_BLOCKS)
+        return 0;
+    pool = kmalloc(nblocks * bs, GFP_KERNEL);
+    map = kmalloc(nblocks * (bs / LAB4FS_DIR_REC_LEN(1)) * sizeof(*map),
+            GFP_KERNEL);
+    bound = kmalloc((nblocks * (bs / LAB4FS_DIR_REC_LEN(1)) + 1) *
+            sizeof(*bound), GFP_KERNEL);
+    buf = kmalloc(bs, GFP_KERNEL);
+    if (!pool || !map || !bound || !buf)
+        goto out;
+
+    for (n = 0; n < npages; n++) {
+        struct page *page = lab4fs_get_page(dir, n);
+        char *kaddr, *limit;
+
+        if (IS_ERR(page)) {
+            err = PTR_ERR(page);
+            goto out;
+        }
+        kaddr = page_address(page);
+        size = dir->i_size - (n << PAGE_CACHE_SHIFT);
+        if (size > PAGE_CACHE_SIZE)
+            size = PAGE_CACHE_SIZE;
+        limit = kaddr + size - LAB4FS_DIR_REC_LEN(1);
+        for (de = (struct lab4fs_dir_entry *)kaddr; (char *)de <= limit;
+                de = lab4fs_next_entry(de)) {
+            if (de->rec_len == 0) {
+                LAB4ERROR("zero-length dir entry\n");
+                lab4fs_put_page(page);
+                err = -EIO;
+                goto out;
+            }
+            if (!de->inode)
+                continue;
+            if (lab4fs_is_dot(de->name, de->name_len)) {
+                if (de->name_len == 2)
+                    parent = de->inode;
+                continue;
+            }
+            size = LAB4FS_DIR_REC_LEN(de->name_len);
+            memcpy(pool + used, de, size);
+            map[count].hash = lab4fs_dirhash(de->name, de->name_len);
+            map[count].offs = used;
+            map[count].size = size;
+            used += size;
+            count++;
+        }
+        lab4fs_put_page(page);
+    }
+    dx_sort_map(map, count);
+
+    /* Fill each leaf, but never put a hash on both sides of a boundary */
+    for (i = 0; i < count || !nleaves; nleaves++) {
+        bound[nleaves] = i;
+        for (size = 0, j = i; j < count && size + map[j].size <= bs; j++)
+            size += map[j].size;
+        while (j < count && j > i && map[j].hash == map[j - 1].hash)
+            j--;
+        if (j == i && count) {
+            err = 0;
+            goto out;
+        }
+        i = j;
+    }
+    bound[nleaves] = count;
+    if (nleaves > dx_root_limit(dir)) {
+        err = 0;
+        goto out;
+    }
+
+    lab4fs_name_cache_drop(dir);
+    lab4fs_free_map_drop(dir);
+    for (i = 0; i < nleaves; i++) {
+        dx_pack(buf, pool, map + bound[i], bound[i + 1] - bound[i], bs);
+        err = lab4fs_write_dir_block(dir, 1 + i, buf);
+        if (err)
+            goto out;
+    }
+    /* The leaves hold every name, get them on disk before the rest goes */
+    err = lab4fs_sync_dir_blocks(dir, 1, 1 + nleaves);
+    if (err)
+        goto out;
+    dx_pack(buf, pool, NULL, 0, bs);
+    for (b = 1 + nleaves; b < nblocks; b++) {
+        err = lab4fs_write_dir_block(dir, b, buf);
+        if (err)
+            goto out;
+    }
+
+    memset(buf, 0, bs);
+    de = (struct lab4fs_dir_entry *)buf;
+    de->inode = cpu_to_le32(dir->i_ino);
+    de->rec_len = cpu_to_le16(LAB4FS_DIR_REC_LEN(1));
+    de->name_len = 1;
+    de->file_type = LAB4FS_FT_DIR;
+    de->name[0] = '.';
+    lab4fs_set_de_tag(dir, de);
+    de = lab4fs_next_entry(de);
+    de->inode = parent;
+    de->rec_len = cpu_to_le16(bs - LAB4FS_DIR_REC_LEN(1));
+    de->name_len = 2;
+    de->file_type = LAB4FS_FT_DIR;
+    de->name[0] = de->name[1] = '.';
+    lab4fs_set_de_tag(dir, de);
+    info = (struct lab4fs_dx_root_info *)(buf + DX_ROOT_INFO);
+    info->hash_version = LAB4FS_HASH_VERSION;
+    info->info_length = sizeof(*info);
+    entries = (struct lab4fs_dx_entry *)(buf + DX_ROOT_ENTRIES);
+    for (i = 0; i < nleaves; i++) {
+        entries[i].hash = cpu_to_le32(map[bound[i]].hash);
+        entries[i].block = cpu_to_le32(1 + i);
+    }
+    dx_set_limit(entries, dx_root_limit(dir));
+    dx_set_count(entries, nleaves);
+    err = lab4fs_write_dir_block(dir, 0, buf);
+    if (err)
+        goto out;
+
+    LAB4FS_I(dir)->i_flags |= LAB4FS_INDEX_FL;
+    mark_inode_dirty(dir);
+out:
+    kfree(pool);
+    kfree(map);
+    kfree(bound);
+    kfree(buf);
+    return err;
+}
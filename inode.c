@@ -2,6 +2,8 @@
 #include <linux/pagemap.h>
 #include <linux/writeback.h>
 #include <linux/mpage.h>
+#include <linux/pagevec.h>
+#include <asm/div64.h>
 
 typedef struct {
 	__le32	*p;
@@ -28,6 +30,9 @@ void print_buffer_head(struct buffer_head *bh, int start, int len)
     __u8 *data;
     int i;
 
+    /* Bitmap blocks are only in memory once they have been used */
+    if (!bh)
+        return;
     data = (__u8 *)(bh->b_data + start);
     LAB4DEBUG("Printing buffer head@%dB, size=%d: \n" KERN_INFO,
             start, len);
@@ -42,20 +47,36 @@ void print_buffer_head(struct buffer_head *bh, int start, int len)
 #define print_buffer_head(bh, start, len)
 #endif
 
+/* First block of the inode table of group */
+static __u32 lab4fs_inode_table(struct super_block *sb, unsigned int group)
+{
+    struct lab4fs_group_desc *gdp;
+
+    if (!LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_GROUPS))
+        return LAB4FS_SB(sb)->s_inode_table;
+    gdp = lab4fs_get_group_desc(sb, group, NULL);
+    if (!gdp)
+        return 0;
+    return le32_to_cpu(gdp->bg_inode_table);
+}
+
 static struct lab4fs_inode *lab4fs_get_inode(struct super_block *sb,
         ino_t ino, struct buffer_head **p)
 {
     struct buffer_head *bh;
     struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
-    __u32 block, offset;
+    __u32 block, offset, table;
 
     *p = NULL;
     if ((ino != LAB4FS_ROOT_INO && ino < LAB4FS_FIRST_INO(sb)) ||
-            ino > le32_to_cpu(sbi->s_sb->s_inodes_count))
+            ino >= sbi->s_inodes_count)
         goto Einval;
-    block = ino >> sbi->s_log_inode_size;
-    offset = ino % sbi->s_inode_size;
-    block += sbi->s_inode_table;
+    block = ino / sbi->s_inodes_per_group;
+    offset = ino % sbi->s_inodes_per_group;
+    if (!(table = lab4fs_inode_table(sb, block)))
+        goto Eio;
+    block = table + offset / sbi->s_inodes_per_block;
+    offset %= sbi->s_inodes_per_block;
 
 	if (!(bh = sb_bread(sb, block)))
         goto Eio;
@@ -81,10 +102,11 @@ void print_raw_inode(struct lab4fs_inode *raw_inode)
     LAB4DEBUG("mode: %X\n", le32_to_cpu(raw_inode->i_mode));
     LAB4DEBUG("nlink: %u\n", le32_to_cpu(raw_inode->i_links_count));
     LAB4DEBUG("data blocks: ");
-    for (i = 0; i < LAB4FS_N_BLOCKS; i++) {
+    for (i = 0; i <= LAB4FS_IND_BLOCK; i++) {
         printk("%u ", le32_to_cpu(raw_inode->i_block[i]));
     } 
-    printk("\n");
+    printk("%u %u\n", le32_to_cpu(raw_inode->i_dind_block),
+            le32_to_cpu(raw_inode->i_tind_block));
 }
 
 void print_inode(struct inode *inode)
@@ -150,13 +172,25 @@ void lab4fs_read_inode(struct inode *inode)
 
     if (!S_ISREG(inode->i_mode))
         ei->i_dir_acl = le32_to_cpu(raw_inode->i_dir_acl);
+    else
+        inode->i_size |= ((__u64)le32_to_cpu(raw_inode->i_dir_acl)) << 32;
+    ei->i_flags = 0;
+    if (LAB4FS_HAS_INCOMPAT_FEATURE(inode->i_sb,
+                LAB4FS_FEATURE_INCOMPAT_EXTENTS |
+                LAB4FS_FEATURE_INCOMPAT_INLINE_DATA |
+                LAB4FS_FEATURE_INCOMPAT_TAIL |
+                LAB4FS_FEATURE_INCOMPAT_DIR_INDEX |
+                LAB4FS_FEATURE_INCOMPAT_DIRHASH))
+        ei->i_flags = le32_to_cpu(raw_inode->i_flags);
 
 	/*
 	 * NOTE! The in-memory inode i_block array is in little-endian order
 	 * even on big-endian machines: we do NOT byteswap the block numbers!
 	 */
-	for (n = 0; n < LAB4FS_N_BLOCKS; n++)
+	for (n = 0; n <= LAB4FS_IND_BLOCK; n++)
 		ei->i_block[n] = raw_inode->i_block[n];
+	ei->i_block[LAB4FS_DIND_BLOCK] = raw_inode->i_dind_block;
+	ei->i_block[LAB4FS_TIND_BLOCK] = raw_inode->i_tind_block;
 
     /*
      * TODO set operations
@@ -187,11 +221,10 @@ static int lab4fs_block_to_path(struct inode *inode,
 			long i_block, int offsets[4], int *boundary)
 {
     int ptrs = LAB4FS_ADDR_PER_BLOCK(inode->i_sb);
+    int ptrs_bits = LAB4FS_ADDR_PER_BLOCK_BITS(inode->i_sb);
     const long direct_blocks = LAB4FS_NDIR_BLOCKS;
     const long indirect_blocks = ptrs;
-    /*
-    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
-    */
+    const long double_blocks = (1 << (ptrs_bits * 2));
     int final = 0;
     int n = 0;
 
@@ -205,6 +238,17 @@ static int lab4fs_block_to_path(struct inode *inode,
 		offsets[n++] = LAB4FS_IND_BLOCK;
         offsets[n++] = i_block;
         final = ptrs;
+    } else if ((i_block -= indirect_blocks) < double_blocks) {
+		offsets[n++] = LAB4FS_DIND_BLOCK;
+		offsets[n++] = i_block >> ptrs_bits;
+		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
+	} else if (((i_block -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
+		offsets[n++] = LAB4FS_TIND_BLOCK;
+		offsets[n++] = i_block >> (ptrs_bits * 2);
+		offsets[n++] = (i_block >> ptrs_bits) & (ptrs - 1);
+		offsets[n++] = i_block & (ptrs - 1);
+		final = ptrs;
     } else {
         LAB4ERROR("block > big\n");
         return 0;
@@ -256,105 +300,191 @@ no_block:
 	return p;
 }
 
-static __u32 lab4fs_alloc_data_block(struct inode *inode, __u32 perfered, long *err)
+/*
+ * Without any better hint, put the data in the inode's own group.  On
+ * a flat fs spread the files over the data area in proportion to their
+ * inode numbers instead, so that each file has room to grow
+ * contiguously after its first block.
+ */
+__u32 lab4fs_inode_goal(struct inode *inode)
 {
-	struct super_block *sb = inode->i_sb;
-    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
-    __u32 start;
-    __u32 found;
-
-    start = perfered - sbi->s_data_blocks;
-    found = bitmap_find_next_zero_bit(&sbi->s_data_bitmap, start, 1);
-
-    if (found > sbi->s_data_bitmap.nr_valid_bits) {
-        found = bitmap_find_next_zero_bit(&sbi->s_data_bitmap, 0, 1);
-        if (found > sbi->s_data_bitmap.nr_valid_bits)
-            goto no_space;
-        goto found_one_free;
-    }
-found_one_free:
-    found += sbi->s_data_blocks;
-    if (found >= sbi->s_blocks_count)
-        goto io_err;
-    write_lock(&sbi->rwlock);
-    sbi->s_free_data_blocks_count--;
-    write_unlock(&sbi->rwlock);
-
-    return found;
-io_err:
-    *err = -EIO;
-    return 0;
-no_space:
-    *err = -ENOSPC;
-    return 0;
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(inode->i_sb);
+    __u64 nr = sbi->s_data_bitmap.nr_valid_bits;
+
+    if (LAB4FS_HAS_INCOMPAT_FEATURE(inode->i_sb,
+                LAB4FS_FEATURE_INCOMPAT_GROUPS))
+        return sbi->s_data_blocks +
+            (inode->i_ino / sbi->s_inodes_per_group) *
+            sbi->s_blocks_per_group;
+
+    nr *= inode->i_ino;
+    do_div(nr, sbi->s_inodes_count);
+    return sbi->s_data_blocks + (__u32)nr;
 }
 
-static Indirect *lab4fs_alloc_branch(struct inode *inode, int depth,
-        int *offsets, Indirect *chain, Indirect *partial, long *err)
+/*
+ * Find a place near which the block missing at ind should go: the
+ * closest previous block referenced from the same index (the search
+ * then lands right after it), else the index block itself, else the
+ * inode's own area.
+ */
+static __u32 lab4fs_find_near(struct inode *inode, Indirect *ind)
 {
-    Indirect *end = chain + depth;
-    Indirect *p = partial;
-    int n = partial - chain;
-    __u32 block;
-    struct buffer_head *bh;
-	struct super_block *sb = inode->i_sb;
-    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __le32 *start = ind->bh ? (__le32 *)ind->bh->b_data : ei->i_block;
+    __le32 *p;
 
+    for (p = ind->p - 1; p >= start; p--)
+        if (*p)
+            return le32_to_cpu(*p);
 
-    block = lab4fs_alloc_data_block(inode, 0, err);
-    if (*err)
-        return p;
-    write_lock(&LAB4FS_I(inode)->rwlock);
-    p->key = cpu_to_le32(block);
-    *(p->p) = p->key;
-    if (p->bh == NULL)
-        mark_inode_dirty(inode);
-    else
-        mark_buffer_dirty(p->bh);
-    inode->i_blocks++;
-    write_unlock(&LAB4FS_I(inode)->rwlock);
+    if (ind->bh)
+        return ind->bh->b_blocknr;
 
-    write_lock(&sbi->rwlock);
-    sbi->s_free_data_blocks_count--;
-	sb->s_dirt = 1;
-    write_unlock(&sbi->rwlock);
-    n++;
-    p++;
+    return lab4fs_inode_goal(inode);
+}
 
-    while (p < end) {
-        bh = sb_bread(sb, block);
+static __u32 lab4fs_find_goal(struct inode *inode, long block,
+        Indirect *partial)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __u32 goal = 0;
 
-        if (!bh) {
-            *err = -EIO;
-            return p;
-        }
+    /* Sequential writes simply continue after the last allocation */
+    read_lock(&ei->rwlock);
+    if (block == ei->i_next_alloc_block + 1 && ei->i_next_alloc_goal)
+        goal = ei->i_next_alloc_goal + 1;
+    read_unlock(&ei->rwlock);
 
-		read_lock(&LAB4FS_I(inode)->rwlock);
-		add_chain(p, bh, (__le32*)bh->b_data + offsets[n]);
-		read_unlock(&LAB4FS_I(inode)->rwlock);
+    if (!goal)
+        goal = lab4fs_find_near(inode, partial);
+    return goal;
+}
 
-        block = lab4fs_alloc_data_block(inode, 0, err);
-        if (*err)
-            return p;
+/*
+ * Allocate the missing part of the chain: the new indirect blocks and
+ * the data block, as one contiguous run starting at goal, so an
+ * indirect block and the data block it points to end up next to each
+ * other.  want is how many data blocks the caller is about to need
+ * (the rest of the page); the first map of them are put in the tree
+ * right away, as far as the leaf has empty slots, and the others are
+ * kept as the inode's preallocation and used by the following calls.
+ *
+ * The new blocks are filled in before the branch is spliced into the
+ * tree, so nobody ever sees a half-built one.  If the tree changed
+ * under us the blocks are given back and -EAGAIN is returned.
+ */
+static int lab4fs_alloc_branch(struct inode *inode, int depth,
+        int *offsets, Indirect *chain, Indirect *partial, __u32 goal,
+        int want, int map)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+	struct super_block *sb = inode->i_sb;
+    int k = partial - chain;
+    int nr_meta = depth - k - 1;
+    __u32 blocks[4];
+    __u32 extra = 0;
+    unsigned long count, nr_extra = 0;
+    int got = 0, mapped, i, j;
+    long err = 0;
+    struct buffer_head *bh;
 
-		write_lock(&LAB4FS_I(inode)->rwlock);
-        p->key = cpu_to_le32(block);
-        *(p->p) = p->key;
-        mark_buffer_dirty(p->bh);
-        inode->i_blocks++;
-		write_unlock(&LAB4FS_I(inode)->rwlock);
+    if (!nr_meta) {
+        blocks[0] = lab4fs_use_prealloc(inode, goal);
+        if (blocks[0])
+            got = 1;
+    }
+    if (!got) {
+        lab4fs_discard_prealloc(inode);
+        count = nr_meta + want;
+        blocks[0] = lab4fs_alloc_blocks(inode, goal, &count, &err);
+        if (err)
+            return err;
+        for (i = 1; i < count && i <= nr_meta; i++)
+            blocks[i] = blocks[0] + i;
+        got = i;
+        if (count > got) {
+            extra = blocks[0] + got;
+            nr_extra = count - got;
+        }
+    }
+    /* The run was cut short, get the rest one way or another */
+    while (got <= nr_meta) {
+        count = nr_meta + 1 - got;
+        blocks[got] = lab4fs_alloc_blocks(inode, blocks[got - 1] + 1,
+                &count, &err);
+        if (err)
+            goto failed;
+        for (i = 1; i < count; i++)
+            blocks[got + i] = blocks[got] + i;
+        got += count;
+    }
+    /* The extra blocks directly follow the data block */
+    mapped = 1 + min_t(unsigned long, map - 1, nr_extra);
 
-        write_lock(&sbi->rwlock);
-        sbi->s_free_data_blocks_count--;
-        sb->s_dirt = 1;
-        write_unlock(&sbi->rwlock);
+    for (i = 1; i <= nr_meta; i++) {
+        /* A fresh indirect block: start it out empty, not with stale data */
+        bh = sb_getblk(sb, blocks[i - 1]);
+        if (!bh) {
+            err = -EIO;
+            goto failed_bh;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        chain[k + i].bh = bh;
+        chain[k + i].p = (__le32 *)bh->b_data + offsets[k + i];
+        chain[k + i].key = cpu_to_le32(blocks[i]);
+        *chain[k + i].p = chain[k + i].key;
+        if (i == nr_meta)
+            for (j = 1; j < mapped; j++)
+                chain[k + i].p[j] = cpu_to_le32(blocks[i] + j);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+    }
 
-        p++;
-        n++;
+    write_lock(&ei->rwlock);
+    if (!verify_chain(chain, partial - 1) || *partial->p) {
+        write_unlock(&ei->rwlock);
+        err = -EAGAIN;
+        goto failed_bh;
     }
+    partial->key = cpu_to_le32(blocks[0]);
+    *partial->p = partial->key;
+    if (!nr_meta) {
+        for (j = 1; j < mapped; j++) {
+            if (partial->p[j])
+                break;
+            partial->p[j] = cpu_to_le32(blocks[0] + j);
+        }
+        mapped = j;
+    }
+    inode->i_blocks += got + mapped - 1;
+    extra += mapped - 1;
+    nr_extra -= mapped - 1;
+    if (nr_extra) {
+        ei->i_prealloc_block = extra;
+        ei->i_prealloc_count = nr_extra;
+    }
+    write_unlock(&ei->rwlock);
 
-    *err = 0;
-    return p;
+    if (partial->bh)
+        mark_buffer_dirty(partial->bh);
+    else
+        mark_inode_dirty(inode);
+    return 0;
+
+failed_bh:
+    while (--i > 0) {
+        bforget(chain[k + i].bh);
+        chain[k + i].bh = NULL;
+    }
+failed:
+    for (i = 0; i < got; i++)
+        lab4fs_free_blocks(inode, blocks[i], 1);
+    if (nr_extra)
+        lab4fs_free_blocks(inode, extra, nr_extra);
+    return err;
 }
 
 #ifdef CONFIG_LAB4FS_DEBUG
@@ -371,18 +501,188 @@ static void print_block_path(struct inode *inode, sector_t iblock,
 #define print_block_path(inode, iblock, offsets, depth)
 #endif
 
-static int lab4fs_get_block(struct inode *inode, sector_t iblock,
-        struct buffer_head *bh_result, int create)
+/*
+ * Start reading the indirect block, or for extents the first tree
+ * node, that the blocks after the direct ones are mapped through, so
+ * that a cold sequential read does not stop to wait for it.
+ */
+void lab4fs_readahead_indirect(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __u32 block;
+
+    if (ei->i_flags & LAB4FS_PACKED_FL)
+        return;
+    if (ei->i_flags & LAB4FS_EXTENTS_FL) {
+        lab4fs_ext_readahead(inode);
+        return;
+    }
+    block = le32_to_cpu(ei->i_block[LAB4FS_IND_BLOCK]);
+    if (block)
+        sb_breadahead(inode->i_sb, block);
+}
+
+/* How close to the end of a leaf a lookup starts reading the next one */
+#define LAB4FS_IND_READAHEAD    16
+
+/*
+ * A lookup got within LAB4FS_IND_READAHEAD blocks of the end of the
+ * leaf chain[depth-1]: read ahead the indirect block mapping what comes
+ * after it.  Past the single indirect block only the double indirect
+ * one itself is read ahead, and a triple indirect tree is not entered.
+ */
+static void lab4fs_readahead_next(struct inode *inode, Indirect *chain,
+        int depth, int *offsets, int slots)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __le32 *p;
+
+    if (slots > LAB4FS_IND_READAHEAD)
+        return;
+    if (depth == 1)
+        p = &ei->i_block[LAB4FS_IND_BLOCK];
+    else if (depth == 2)
+        p = &ei->i_block[LAB4FS_DIND_BLOCK];
+    else if (offsets[depth-2] + 1 < LAB4FS_ADDR_PER_BLOCK(inode->i_sb))
+        p = chain[depth-2].p + 1;
+    else
+        return;
+    if (*p)
+        sb_breadahead(inode->i_sb, le32_to_cpu(*p));
+}
+
+/*
+ * How many of the pointers from p on, up to max and not past end, map
+ * blocks following the one p maps.
+ */
+static int lab4fs_count_run(__le32 *p, __le32 *end, int max)
+{
+    __u32 first = le32_to_cpu(*p);
+    int n;
+
+    for (n = 1; n < max && p + n < end; n++)
+        if (le32_to_cpu(p[n]) != first + n)
+            break;
+    return n;
+}
+
+/*
+ * The last run of blocks lab4fs_map_block found is kept in the inode,
+ * so that lookups on hot files skip the walk from i_block.  Only blocks
+ * that are in the tree are cached, so allocation never makes the run
+ * stale; whatever takes blocks out of the tree must invalidate it.
+ * A run found before an invalidation is not cached after it: callers
+ * sample the generation before they look and pass it in.
+ */
+unsigned lab4fs_map_cache_gen(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    unsigned gen;
+
+    read_lock(&ei->rwlock);
+    gen = ei->i_map_gen;
+    read_unlock(&ei->rwlock);
+    return gen;
+}
+
+void lab4fs_map_cache_set(struct inode *inode, unsigned gen,
+        __u32 lblock, __u32 pblock, __u32 len)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    write_lock(&ei->rwlock);
+    if (ei->i_map_gen == gen) {
+        ei->i_map_lblock = lblock;
+        ei->i_map_pblock = pblock;
+        ei->i_map_len = len;
+    }
+    write_unlock(&ei->rwlock);
+}
+
+void lab4fs_map_cache_invalidate(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    write_lock(&ei->rwlock);
+    ei->i_map_len = 0;
+    ei->i_map_gen++;
+    write_unlock(&ei->rwlock);
+}
+
+/*
+ * If iblock is in the cached run, return how many blocks of the run
+ * start at it and its physical block in *pblock; 0 otherwise.  The
+ * generation is returned in *gen either way.
+ */
+static int lab4fs_map_cache_lookup(struct inode *inode, sector_t iblock,
+        __u32 *pblock, unsigned *gen)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    int n = 0;
+
+    read_lock(&ei->rwlock);
+    *gen = ei->i_map_gen;
+    if (iblock >= ei->i_map_lblock &&
+            iblock - ei->i_map_lblock < ei->i_map_len) {
+        *pblock = ei->i_map_pblock + (iblock - ei->i_map_lblock);
+        n = ei->i_map_len - (iblock - ei->i_map_lblock);
+    }
+    read_unlock(&ei->rwlock);
+    return n;
+}
+
+/*
+ * Map iblock of inode into bh_result, allocating it if create is set.
+ * want is how many blocks from iblock on the caller expects to need;
+ * 0 means the rest of the page.  Up to maxblocks physically contiguous
+ * blocks are mapped, and newly allocated ones put in the tree, at once.
+ * Return how many were mapped, 0 for a hole.
+ */
+static int lab4fs_map_block(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh_result, int create, int want, int maxblocks)
 {
 	long err = -EIO;
 	int offsets[4];
 	Indirect chain[4];
 	Indirect *partial;
-    int boundary = 0;
-    int depth = lab4fs_block_to_path(inode, iblock, offsets, &boundary);
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __le32 *end;
+    __u32 goal, block;
+    unsigned gen;
+    int depth, slots, run, count = 0;
 
+    /* Packed inodes have no blocks, callers move the data out first */
+    if (ei->i_flags & LAB4FS_PACKED_FL)
+        return -EIO;
+    count = lab4fs_map_cache_lookup(inode, iblock, &block, &gen);
+    if (count) {
+        map_bh(bh_result, inode->i_sb, block);
+        return min(count, maxblocks);
+    }
+
+    /*
+     * The page cache maps a page one block at a time, so ask for the
+     * rest of the page up front, as far as the leaf index reaches.
+     */
+    if (want <= 0)
+        want = (PAGE_CACHE_SIZE >> inode->i_blkbits) -
+            (iblock & ((PAGE_CACHE_SIZE >> inode->i_blkbits) - 1));
+    if (ei->i_flags & LAB4FS_EXTENTS_FL)
+        return lab4fs_ext_get_block(inode, iblock, bh_result, create, want,
+                maxblocks);
+
+    depth = lab4fs_block_to_path(inode, iblock, offsets, NULL);
     if (depth == 0)
         goto out;
+    /* Runs never cross into the next leaf */
+    if (depth == 1)
+        slots = LAB4FS_NDIR_BLOCKS - offsets[0];
+    else
+        slots = LAB4FS_ADDR_PER_BLOCK(inode->i_sb) - offsets[depth-1];
+    if (want > slots)
+        want = slots;
+    if (maxblocks > slots)
+        maxblocks = slots;
 
 reread:
 	partial = lab4fs_get_branch(inode, depth, offsets, chain, &err);
@@ -391,8 +691,22 @@ reread:
 	if (!partial) {
 got_it:
 		map_bh(bh_result, inode->i_sb, le32_to_cpu(chain[depth-1].key));
-		if (boundary)
+        if (depth == 1)
+            end = ei->i_block + LAB4FS_NDIR_BLOCKS;
+        else
+            end = (__le32 *)chain[depth-1].bh->b_data +
+                LAB4FS_ADDR_PER_BLOCK(inode->i_sb);
+        /* Cache the whole run, so later lookups in this leaf hit */
+        run = lab4fs_count_run(chain[depth-1].p, end, slots);
+        lab4fs_map_cache_set(inode, gen, iblock,
+                le32_to_cpu(chain[depth-1].key), run);
+        count = min(run, maxblocks);
+		if (count == slots)
 			set_buffer_boundary(bh_result);
+        /* Cache hits skip this, so look past the end of the run */
+        if (!create)
+            lab4fs_readahead_next(inode, chain, depth, offsets,
+                    slots - run + 1);
 		/* Clean up and exit */
 		partial = chain+depth-1; /* the whole chain */
 		goto cleanup;
@@ -405,7 +719,7 @@ cleanup:
 			partial--;
 		}
 out:
-        return err;
+        return err ? err : count;
     }
 
 	/*
@@ -416,9 +730,21 @@ out:
 	if (err == -EAGAIN)
 		goto changed;
 
-    partial = lab4fs_alloc_branch(inode, depth, offsets, chain, partial, &err);
+    if (want < maxblocks)
+        want = maxblocks;
+    goal = lab4fs_find_goal(inode, iblock, partial);
+    err = lab4fs_alloc_branch(inode, depth, offsets, chain, partial,
+            goal, want, maxblocks);
+    if (err == -EAGAIN)
+        goto changed;
     if (err)
-        return err;
+        goto cleanup;
+
+    set_buffer_new(bh_result);
+    write_lock(&ei->rwlock);
+    ei->i_next_alloc_block = iblock;
+    ei->i_next_alloc_goal = le32_to_cpu(chain[depth-1].key);
+    write_unlock(&ei->rwlock);
     goto got_it;
 
 changed:
@@ -429,6 +755,392 @@ changed:
 	goto reread;
 }
 
+static int lab4fs_get_block(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh_result, int create)
+{
+    int ret = lab4fs_map_block(inode, iblock, bh_result, create, 0, 1);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * How many indirect blocks, or extent tree nodes, would have to be
+ * allocated along with iblock.  *leaf is set to the first block mapped
+ * through the same leaf, so that callers can tell blocks sharing it.
+ */
+static int lab4fs_missing_meta(struct inode *inode, sector_t iblock,
+        sector_t *leaf)
+{
+	int offsets[4];
+	Indirect chain[4];
+	Indirect *partial;
+    long err;
+    int depth, missing = 0;
+
+    *leaf = iblock;
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_EXTENTS_FL)
+        return lab4fs_ext_missing_meta(inode, iblock, leaf);
+    depth = lab4fs_block_to_path(inode, iblock, offsets, NULL);
+    if (depth < 2)
+        return 0;
+    *leaf = iblock - offsets[depth - 1];
+	partial = lab4fs_get_branch(inode, depth, offsets, chain, &err);
+    if (partial)
+        missing = depth - 1 - (partial - chain);
+    else
+        partial = chain + depth - 1;
+    while (partial > chain) {
+        brelse(partial->bh);
+        partial--;
+    }
+    return missing;
+}
+
+/*
+ * get_block for buffered writes to regular files: a hole is only
+ * reserved, see lab4fs_reserve_delayed.  The buffer is new, so
+ * block_prepare_write zeroes what the write does not cover, and delay,
+ * so nothing reads it from LAB4FS_DELAYED_BLOCK.
+ */
+static int lab4fs_get_block_delayed(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh_result, int create)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    sector_t leaf;
+    int meta, err;
+
+    err = lab4fs_get_block(inode, iblock, bh_result, 0);
+    if (err || buffer_mapped(bh_result) || !create)
+        return err;
+
+    /* Writers hold i_sem, so i_delayed_meta_leaf is stable here */
+    meta = lab4fs_missing_meta(inode, iblock, &leaf);
+    /* The delayed blocks may fill an extent leaf with room left today */
+    if (!meta && (ei->i_flags & LAB4FS_EXTENTS_FL))
+        meta = 1;
+    if (meta && ei->i_delayed_meta && leaf == ei->i_delayed_meta_leaf)
+        meta = 0;
+    err = lab4fs_reserve_delayed(inode, meta);
+    if (err)
+        return err;
+    if (meta)
+        ei->i_delayed_meta_leaf = leaf;
+    map_bh(bh_result, inode->i_sb, LAB4FS_DELAYED_BLOCK);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
+
+/*
+ * Give a delayed buffer its real block.  All the blocks the inode still
+ * has delayed are asked for at once, so a file written in one go gets
+ * one run; what this page does not use stays as preallocation for the
+ * next ones, and stands in for their reservations until it is used up
+ * or discarded.
+ */
+static int lab4fs_map_delayed(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    sector_t leaf;
+    int want, meta, err;
+    __u32 backed;
+
+    read_lock(&ei->rwlock);
+    want = ei->i_delayed_blocks;
+    read_unlock(&ei->rwlock);
+    meta = lab4fs_missing_meta(inode, iblock, &leaf);
+
+    /* Hand the reservation back first, the allocator checks against it */
+    lab4fs_release_delayed(inode, 1, meta);
+    clear_buffer_mapped(bh);
+    err = lab4fs_map_block(inode, iblock, bh, 1, want, 1);
+    if (err < 0) {
+        LAB4ERROR("cannot allocate delayed block %lu of inode %lu: %d\n",
+                (unsigned long)iblock, inode->i_ino, err);
+        /* Still delayed, indirect blocks and all */
+        write_lock(&ei->rwlock);
+        ei->i_delayed_blocks++;
+        ei->i_delayed_meta += meta;
+        write_unlock(&ei->rwlock);
+        percpu_counter_mod(&LAB4FS_SB(inode->i_sb)->s_delayed_blocks_counter,
+                1 + meta);
+        map_bh(bh, inode->i_sb, LAB4FS_DELAYED_BLOCK);
+        return err;
+    }
+    clear_buffer_delay(bh);
+
+    /* The blocks claimed ahead are no longer owed to the delayed ones */
+    write_lock(&ei->rwlock);
+    backed = min(ei->i_prealloc_count, ei->i_delayed_blocks);
+    if (backed > ei->i_prealloc_delayed) {
+        backed -= ei->i_prealloc_delayed;
+        ei->i_prealloc_delayed += backed;
+    } else
+        backed = 0;
+    write_unlock(&ei->rwlock);
+    if (backed)
+        percpu_counter_mod(&LAB4FS_SB(inode->i_sb)->s_delayed_blocks_counter,
+                -(long)backed);
+
+    if (buffer_new(bh)) {
+        clear_buffer_new(bh);
+        unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+    }
+    return 0;
+}
+
+/* Map the delayed buffers of a locked page */
+static int lab4fs_map_delayed_page(struct inode *inode, struct page *page)
+{
+    struct buffer_head *head, *bh;
+    sector_t iblock;
+    int err = 0;
+
+    if (!page_has_buffers(page))
+        return 0;
+    iblock = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+    head = bh = page_buffers(page);
+    do {
+        if (buffer_delay(bh)) {
+            err = lab4fs_map_delayed(inode, iblock, bh);
+            if (err)
+                break;
+        }
+        iblock++;
+        bh = bh->b_this_page;
+    } while (bh != head);
+    return err;
+}
+
+/*
+ * Whether writeback should put page 0 of inode in fragments rather than
+ * give it a block: the file is small and nothing of it has a block yet.
+ */
+static int lab4fs_tail_wanted(struct inode *inode, struct page *page)
+{
+    if (!test_opt(inode->i_sb, TAIL) || !S_ISREG(inode->i_mode) ||
+            page->index != 0 || inode->i_blocks)
+        return 0;
+    if (!inode->i_size || inode->i_size > LAB4FS_TAIL_MAX(inode->i_sb))
+        return 0;
+    return page_has_buffers(page) && buffer_delay(page_buffers(page));
+}
+
+/*
+ * Allocate the delayed blocks of every dirty page of mapping, in file
+ * order, before any of them is written.  Errors are left for writepage
+ * to report.
+ */
+static void lab4fs_map_delayed_range(struct address_space *mapping)
+{
+    struct pagevec pvec;
+    pgoff_t index = 0;
+    int i, nr;
+
+    pagevec_init(&pvec, 0);
+    while ((nr = pagevec_lookup_tag(&pvec, mapping, &index,
+                    PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE))) {
+        for (i = 0; i < nr; i++) {
+            struct page *page = pvec.pages[i];
+
+            lock_page(page);
+            if (page->mapping == mapping &&
+                    !lab4fs_tail_wanted(mapping->host, page))
+                lab4fs_map_delayed_page(mapping->host, page);
+            unlock_page(page);
+        }
+        pagevec_release(&pvec);
+        cond_resched();
+    }
+}
+
+/*
+ * A file no bigger than LAB4FS_INLINE_SIZE may keep its data in i_block,
+ * see LAB4FS_INLINE_DATA_FL, and one smaller than a block in fragments
+ * of a block shared with others, see tail.c.  Only page 0 of such a
+ * packed file has data, and it is never dirty: writes go to i_block or
+ * the fragments as they are committed.  The flags change, and the data
+ * moves, with both i_sem and page 0 held, so writers and readpage can
+ * test them without ei->rwlock.
+ */
+static unsigned lab4fs_packed_room(struct inode *inode)
+{
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_TAIL_FL)
+        return lab4fs_tail_room(inode);
+    return LAB4FS_INLINE_SIZE;
+}
+
+static int lab4fs_packed_fill(struct inode *inode, struct page *page)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    unsigned size = 0;
+    char *kaddr;
+    int err = 0;
+
+    if (page->index == 0)
+        size = min_t(loff_t, inode->i_size, lab4fs_packed_room(inode));
+    kaddr = kmap(page);
+    if (!size) {
+        ;
+    } else if (ei->i_flags & LAB4FS_TAIL_FL) {
+        err = lab4fs_tail_read(inode, kaddr, size);
+    } else {
+        read_lock(&ei->rwlock);
+        memcpy(kaddr, ei->i_block, size);
+        read_unlock(&ei->rwlock);
+    }
+    memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap(page);
+    if (!err)
+        SetPageUptodate(page);
+    return err;
+}
+
+/*
+ * Copy what page 0 has below i_size back to where the data is kept.
+ * With page NULL, only zero what is past i_size.
+ */
+static int lab4fs_packed_store(struct inode *inode, struct page *page)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    unsigned size;
+    char *kaddr = NULL;
+    int err = 0;
+
+    if (page && page->index != 0)
+        return 0;
+    size = min_t(loff_t, inode->i_size, lab4fs_packed_room(inode));
+    if (page)
+        kaddr = kmap(page);
+    if (ei->i_flags & LAB4FS_TAIL_FL) {
+        err = lab4fs_tail_write(inode, kaddr, size);
+    } else {
+        write_lock(&ei->rwlock);
+        if (kaddr)
+            memcpy(ei->i_block, kaddr, size);
+        memset((char *)ei->i_block + size, 0, LAB4FS_INLINE_SIZE - size);
+        write_unlock(&ei->rwlock);
+        mark_inode_dirty(inode);
+    }
+    if (page)
+        kunmap(page);
+    return err;
+}
+
+/*
+ * Move the data of a packed inode to a block of its own.  page is page
+ * 0, locked.  The inode is given the mapping a new file would get, and
+ * the data becomes a delayed write of page 0.
+ */
+static int lab4fs_unpack(struct inode *inode, struct page *page)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __le32 data[LAB4FS_N_BLOCKS];
+    unsigned size;
+    __u32 flags = ei->i_flags;
+    int err = 0;
+
+    if (!(flags & LAB4FS_PACKED_FL))
+        return 0;
+    /* A file grown by truncate has nothing stored past the room */
+    size = min_t(loff_t, inode->i_size, lab4fs_packed_room(inode));
+    if (!PageUptodate(page)) {
+        err = lab4fs_packed_fill(inode, page);
+        if (err)
+            return err;
+    }
+
+    write_lock(&ei->rwlock);
+    memcpy(data, ei->i_block, sizeof(data));
+    memset(ei->i_block, 0, sizeof(ei->i_block));
+    ei->i_flags &= ~LAB4FS_PACKED_FL;
+    write_unlock(&ei->rwlock);
+    if (test_opt(inode->i_sb, EXTENTS)) {
+        ei->i_flags |= LAB4FS_EXTENTS_FL;
+        lab4fs_ext_tree_init(inode);
+    }
+
+    if (size) {
+        err = block_prepare_write(page, 0, size, lab4fs_get_block_delayed);
+        if (!err)
+            err = block_commit_write(page, 0, size);
+    }
+    if (err) {
+        write_lock(&ei->rwlock);
+        memcpy(ei->i_block, data, sizeof(data));
+        ei->i_flags = flags;
+        write_unlock(&ei->rwlock);
+        return err;
+    }
+    if (flags & LAB4FS_TAIL_FL)
+        lab4fs_tail_free(inode, data);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * lab4fs_unpack for callers not holding page 0, under i_sem.  With
+ * allocate set, the block is allocated at once rather than delayed, so
+ * that writeback does not pack the data again.
+ */
+static int lab4fs_unpack_inode(struct inode *inode, int allocate)
+{
+    struct page *page;
+    int err;
+
+    if (!(LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL))
+        return 0;
+    page = grab_cache_page(inode->i_mapping, 0);
+    if (!page)
+        return -ENOMEM;
+    err = lab4fs_unpack(inode, page);
+    if (!err && allocate)
+        err = lab4fs_map_delayed_page(inode, page);
+    unlock_page(page);
+    page_cache_release(page);
+    return err;
+}
+
+/*
+ * Write out page 0 of a small file into fragments, in place of the block
+ * it has reserved.  The flags change under i_sem, which writepage cannot
+ * wait for: if a writer has it, the page gets its block as usual.
+ */
+static int lab4fs_tail_pack(struct inode *inode, struct page *page)
+{
+    struct buffer_head *head, *bh;
+    char *kaddr;
+    int err, nr = 0;
+
+    if (down_trylock(&inode->i_sem))
+        return -EAGAIN;
+    if (!lab4fs_tail_wanted(inode, page)) {
+        up(&inode->i_sem);
+        return -EAGAIN;
+    }
+    kaddr = kmap(page);
+    err = lab4fs_tail_alloc(inode, kaddr, inode->i_size);
+    kunmap(page);
+    up(&inode->i_sem);
+    if (err)
+        return err;
+
+    head = bh = page_buffers(page);
+    do {
+        if (buffer_delay(bh)) {
+            clear_buffer_delay(bh);
+            nr++;
+        }
+        bh = bh->b_this_page;
+    } while (bh != head);
+    lab4fs_release_delayed(inode, nr, 0);
+    /* The buffers would map the file blocks, which it no longer has */
+    block_invalidatepage(page, 0);
+    return 0;
+}
+
 static int lab4fs_update_inode(struct inode *inode, int do_sync)
 {
     struct lab4fs_inode_info *ei = LAB4FS_I(inode);
@@ -467,8 +1179,13 @@ static int lab4fs_update_inode(struct inode *inode, int do_sync)
 	raw_inode->i_file_acl = cpu_to_le32(ei->i_file_acl);
 	if (!S_ISREG(inode->i_mode))
 		raw_inode->i_dir_acl = cpu_to_le32(ei->i_dir_acl);
-	for (n = 0; n < LAB4FS_N_BLOCKS; n++)
+	else
+		raw_inode->i_dir_acl = cpu_to_le32(inode->i_size >> 32);
+	raw_inode->i_flags = cpu_to_le32(ei->i_flags);
+	for (n = 0; n <= LAB4FS_IND_BLOCK; n++)
 		raw_inode->i_block[n] = ei->i_block[n];
+	raw_inode->i_dind_block = ei->i_block[LAB4FS_DIND_BLOCK];
+	raw_inode->i_tind_block = ei->i_block[LAB4FS_TIND_BLOCK];
     write_unlock(&ei->rwlock);
 	mark_buffer_dirty(bh);
 	if (do_sync) {
@@ -483,22 +1200,158 @@ static int lab4fs_update_inode(struct inode *inode, int do_sync)
 	return err;
 }
 
+/*
+ * Free the block nr, depth levels of indirect blocks above the data,
+ * and all it maps.  The branch is already out of the tree.
+ */
+static void lab4fs_free_branch(struct inode *inode, __u32 nr, int depth,
+        struct lab4fs_free_batch *fb)
+{
+    struct super_block *sb = inode->i_sb;
+    int ptrs = LAB4FS_ADDR_PER_BLOCK(sb);
+    struct buffer_head *bh;
+    __le32 *p;
+    int i;
+
+    if (depth) {
+        bh = sb_bread(sb, nr);
+        if (!bh) {
+            LAB4ERROR("cannot read indirect block %u of inode %lu\n", nr,
+                    inode->i_ino);
+            return;
+        }
+        p = (__le32 *)bh->b_data;
+        /* Get the reads of the next level of indirect blocks going */
+        if (depth > 1)
+            for (i = 0; i < ptrs; i++)
+                if (p[i])
+                    sb_breadahead(sb, le32_to_cpu(p[i]));
+        for (i = 0; i < ptrs; i++)
+            if (p[i])
+                lab4fs_free_branch(inode, le32_to_cpu(p[i]), depth - 1, fb);
+        bforget(bh);
+    }
+    /* After what it maps, which lab4fs_alloc_branch put right behind it */
+    lab4fs_free_batch_add(fb, nr, 1);
+}
+
+/*
+ * Cut the branch at *p, depth levels of indirect blocks above the data,
+ * down to the first from blocks it maps.  p is in bh, or in i_block if
+ * bh is NULL.
+ */
+static void lab4fs_truncate_branch(struct inode *inode, __le32 *p,
+        struct buffer_head *bh, int depth, unsigned long from,
+        struct lab4fs_free_batch *fb)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    int ptrs = LAB4FS_ADDR_PER_BLOCK(inode->i_sb);
+    int shift = LAB4FS_ADDR_PER_BLOCK_BITS(inode->i_sb) * (depth - 1);
+    struct buffer_head *ibh;
+    __u32 nr = le32_to_cpu(*p);
+    int i;
+
+    if (!nr)
+        return;
+    if (!from) {
+        /* Out of the tree first, so lookups under way see it changed */
+        write_lock(&ei->rwlock);
+        *p = 0;
+        write_unlock(&ei->rwlock);
+        if (bh)
+            mark_buffer_dirty(bh);
+        else
+            mark_inode_dirty(inode);
+        lab4fs_map_cache_invalidate(inode);
+        lab4fs_free_branch(inode, nr, depth, fb);
+        return;
+    }
+
+    ibh = sb_bread(inode->i_sb, nr);
+    if (!ibh) {
+        LAB4ERROR("cannot read indirect block %u of inode %lu\n", nr,
+                inode->i_ino);
+        return;
+    }
+    for (i = from >> shift, from &= (1UL << shift) - 1; i < ptrs;
+            i++, from = 0)
+        lab4fs_truncate_branch(inode, (__le32 *)ibh->b_data + i, ibh,
+                depth - 1, from, fb);
+    brelse(ibh);
+}
+
+/*
+ * Give back the blocks of inode past i_size.  Called by vmtruncate once
+ * the pages past it are gone, and on delete and directory compaction,
+ * all with writers kept out.  The blocks go back to the bitmap in runs,
+ * see lab4fs_free_batch_add, and the free count changes once.
+ */
+void lab4fs_truncate(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    int bits = LAB4FS_ADDR_PER_BLOCK_BITS(inode->i_sb);
+    struct lab4fs_free_batch fb;
+    unsigned long iblock, start = LAB4FS_NDIR_BLOCKS, span;
+    int n, depth;
+
+    if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode)))
+        return;
+    if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+        return;
+    /* Packed inodes have no blocks, lab4fs_setattr sees to them */
+    if (ei->i_flags & LAB4FS_PACKED_FL)
+        return;
+
+    block_truncate_page(inode->i_mapping, inode->i_size, lab4fs_get_block);
+    lab4fs_discard_prealloc(inode);
+    lab4fs_discard_reservation(inode);
+    iblock = (inode->i_size + inode->i_sb->s_blocksize - 1) >>
+        inode->i_blkbits;
+
+    lab4fs_free_batch_init(&fb, inode);
+    if (ei->i_flags & LAB4FS_EXTENTS_FL) {
+        lab4fs_ext_truncate(inode, iblock, &fb);
+        goto done;
+    }
+    for (n = min_t(unsigned long, iblock, LAB4FS_NDIR_BLOCKS);
+            n < LAB4FS_NDIR_BLOCKS; n++)
+        lab4fs_truncate_branch(inode, ei->i_block + n, NULL, 0, 0, &fb);
+    for (n = LAB4FS_IND_BLOCK, depth = 1; n <= LAB4FS_TIND_BLOCK;
+            n++, depth++) {
+        span = 1UL << (bits * depth);
+        if (iblock < start + span)
+            lab4fs_truncate_branch(inode, ei->i_block + n, NULL, depth,
+                    iblock > start ? iblock - start : 0, &fb);
+        start += span;
+    }
+
+done:
+    lab4fs_free_batch_end(&fb);
+    write_lock(&ei->rwlock);
+    inode->i_blocks -= min_t(unsigned long, fb.nr, inode->i_blocks);
+    write_unlock(&ei->rwlock);
+    if (IS_SYNC(inode))
+        lab4fs_sync_inode(inode);
+    else
+        mark_inode_dirty(inode);
+}
+
 static void lab4fs_free_inode(struct inode *inode)
 {
     struct lab4fs_inode_info *ei = LAB4FS_I(inode);
     struct super_block *sb = inode->i_sb;
     struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
 	unsigned long ino;
+    int mode;
 
     ino = inode->i_ino;
+    mode = inode->i_mode;
 	clear_inode (inode);
     LAB4DEBUG("clear %luth bit in inode bitmap. Before clear:\n", ino);
-    print_buffer_head(sbi->s_inode_bitmap.bhs[0], 0, 12);
-    write_lock(&sbi->rwlock);
-    bitmap_clear_bit(&sbi->s_inode_bitmap, ino);
-    write_unlock(&sbi->rwlock);
+    print_buffer_head(sbi->s_inode_bitmap.blocks[0].bh, 0, 12);
+    lab4fs_free_ino(sb, ino, mode);
     LAB4DEBUG("clear %luth bit in inode bitmap. After clear:\n", ino);
-    print_buffer_head(sbi->s_inode_bitmap.bhs[0], 0, 12);
+    print_buffer_head(sbi->s_inode_bitmap.blocks[0].bh, 0, 12);
 }
 
 void lab4fs_delete_inode (struct inode * inode)
@@ -508,10 +1361,14 @@ void lab4fs_delete_inode (struct inode * inode)
         goto no_delete;
 
     ei = LAB4FS_I(inode);
+    if (ei->i_flags & LAB4FS_TAIL_FL)
+        lab4fs_tail_free(inode, ei->i_block);
     ei->i_dtime = get_seconds();
 	mark_inode_dirty(inode);
 	lab4fs_update_inode(inode, inode_needs_sync(inode));
 	inode->i_size = 0;
+    if (inode->i_blocks)
+        lab4fs_truncate(inode);
     lab4fs_free_inode (inode);
     return;
 no_delete:
@@ -550,28 +1407,15 @@ struct inode *lab4fs_new_inode(struct inode *dir, int mode)
     ei = LAB4FS_I(inode);
     sbi = LAB4FS_SB(sb);
 
-    read_lock(&sbi->rwlock);
-    if (sbi->s_free_inodes_count == 0) {
-        read_unlock(&sbi->rwlock);
-        err = -ENOSPC;
-        goto fail;
-    }
-    read_unlock(&sbi->rwlock);
-
     LAB4DEBUG("create a new inode. inode bitmap:\n");
-    print_buffer_head(sbi->s_inode_bitmap.bhs[0], 0, 12);
-    ino = bitmap_find_next_zero_bit(&sbi->s_inode_bitmap, sbi->s_first_ino, 1);
-
-    if (ino >= sbi->s_inodes_count || ino < sbi->s_first_ino) {
+    print_buffer_head(sbi->s_inode_bitmap.blocks[0].bh, 0, 12);
+    ino = lab4fs_alloc_ino(dir, mode);
+    if (!ino) {
         err = -ENOSPC;
         goto fail;
     }
 
-    write_lock(&sbi->rwlock);
-    sbi->s_free_inodes_count--;
-	sb->s_dirt = 1;
-	inode->i_generation = sbi->s_next_generation++;
-    write_unlock(&sbi->rwlock);
+	inode->i_generation = atomic_inc_return(&sbi->s_next_generation);
 
 	inode->i_ino = ino;
 	inode->i_mode = mode;
@@ -584,7 +1428,13 @@ struct inode *lab4fs_new_inode(struct inode *dir, int mode)
 	memset(ei->i_block, 0, sizeof(ei->i_block));
 	ei->i_file_acl = 0;
 	ei->i_dir_acl = 0;
-	inode->i_generation = sbi->s_next_generation++;
+	ei->i_flags = 0;
+    if (S_ISREG(mode) && test_opt(sb, INLINE_DATA)) {
+        ei->i_flags |= LAB4FS_INLINE_DATA_FL;
+    } else if (S_ISREG(mode) && test_opt(sb, EXTENTS)) {
+        ei->i_flags |= LAB4FS_EXTENTS_FL;
+        lab4fs_ext_tree_init(inode);
+    }
 
 	insert_inode_hash(inode);
     mark_inode_dirty(inode);
@@ -604,7 +1454,18 @@ int lab4fs_setattr(struct dentry *dentry, struct iattr *iattr)
     error = inode_change_ok(inode, iattr);
     if (error)
         return error;
+    if ((iattr->ia_valid & ATTR_SIZE) &&
+            (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL) &&
+            iattr->ia_size > lab4fs_packed_room(inode)) {
+        error = lab4fs_unpack_inode(inode, 0);
+        if (error)
+            return error;
+    }
 	error = inode_setattr(inode, iattr);
+    /* What is cut off must read back as zeroes if the file grows again */
+    if (!error && (iattr->ia_valid & ATTR_SIZE) &&
+            (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL))
+        error = lab4fs_packed_store(inode, NULL);
     return error;
 }
 
@@ -643,11 +1504,45 @@ int lab4fs_permission(struct inode *inode, int mask, struct nameidata *nd)
 
 static int lab4fs_writepage(struct page *page, struct writeback_control *wbc)
 {
+    struct inode *inode = page->mapping->host;
+    int err;
+
+    /* Written through mmap */
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL) {
+        err = lab4fs_packed_store(inode, page);
+        if (err)
+            redirty_page_for_writepage(wbc, page);
+        unlock_page(page);
+        return err;
+    }
+    if (lab4fs_tail_wanted(inode, page) && !lab4fs_tail_pack(inode, page)) {
+        unlock_page(page);
+        return 0;
+    }
+    if (S_ISREG(inode->i_mode)) {
+        err = lab4fs_map_delayed_page(inode, page);
+        if (err) {
+            redirty_page_for_writepage(wbc, page);
+            unlock_page(page);
+            return err;
+        }
+    }
 	return block_write_full_page(page, lab4fs_get_block, wbc);
 }
 
 static int lab4fs_readpage(struct file *file, struct page *page)
 {
+    struct inode *inode = page->mapping->host;
+
+    int err;
+
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL) {
+        err = lab4fs_packed_fill(inode, page);
+        if (err)
+            SetPageError(page);
+        unlock_page(page);
+        return err;
+    }
 	return mpage_readpage(page, lab4fs_get_block);
 }
 
@@ -655,6 +1550,9 @@ static int
 lab4fs_readpages(struct file *file, struct address_space *mapping,
 		struct list_head *pages, unsigned nr_pages)
 {
+    if (LAB4FS_I(mapping->host)->i_flags & LAB4FS_PACKED_FL)
+        return read_cache_pages(mapping, pages,
+                (filler_t *)lab4fs_readpage, file);
 	return mpage_readpages(mapping, pages, nr_pages, lab4fs_get_block);
 }
 
@@ -662,11 +1560,49 @@ static int
 lab4fs_prepare_write(struct file *file, struct page *page,
 			unsigned from, unsigned to)
 {
+    struct inode *inode = page->mapping->host;
+    int err;
+
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL) {
+        if (page->index == 0 && to <= lab4fs_packed_room(inode)) {
+            if (!PageUptodate(page))
+                return lab4fs_packed_fill(inode, page);
+            return 0;
+        }
+        if (page->index == 0)
+            err = lab4fs_unpack(inode, page);
+        else
+            err = lab4fs_unpack_inode(inode, 0);
+        if (err)
+            return err;
+    }
+    if (S_ISREG(inode->i_mode))
+        return block_prepare_write(page, from, to, lab4fs_get_block_delayed);
 	return block_prepare_write(page,from,to,lab4fs_get_block);
 }
 
+static int lab4fs_commit_write(struct file *file, struct page *page,
+        unsigned from, unsigned to)
+{
+    struct inode *inode = page->mapping->host;
+    loff_t pos = ((loff_t)page->index << PAGE_CACHE_SHIFT) + to;
+
+    if (!(LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL))
+        return generic_commit_write(file, page, from, to);
+    if (pos > inode->i_size) {
+        i_size_write(inode, pos);
+        mark_inode_dirty(inode);
+    }
+    return lab4fs_packed_store(inode, page);
+}
+
 static sector_t lab4fs_bmap(struct address_space *mapping, sector_t block)
 {
+    if (LAB4FS_I(mapping->host)->i_flags & LAB4FS_PACKED_FL)
+        return 0;
+    /* Delayed blocks have no number yet */
+    if (LAB4FS_I(mapping->host)->i_delayed_blocks)
+        filemap_write_and_wait(mapping);
 	return generic_block_bmap(mapping,block,lab4fs_get_block);
 }
 
@@ -676,10 +1612,12 @@ lab4fs_get_blocks(struct inode *inode, sector_t iblock, unsigned long max_blocks
 {
 	int ret;
 
-	ret = lab4fs_get_block(inode, iblock, bh_result, create);
-	if (ret == 0)
-		bh_result->b_size = (1 << inode->i_blkbits);
-	return ret;
+	ret = lab4fs_map_block(inode, iblock, bh_result, create, max_blocks,
+            max_blocks);
+	if (ret < 0)
+		return ret;
+	bh_result->b_size = max(ret, 1) << inode->i_blkbits;
+	return 0;
 }
 
 static ssize_t
@@ -688,7 +1626,23 @@ lab4fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
 {
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
+    int err;
 
+    /*
+     * Give the data a block to go to or come from.  Writers hold i_sem
+     * already, and blockdev_direct_IO takes it for readers after this.
+     */
+    if (LAB4FS_I(inode)->i_flags & LAB4FS_PACKED_FL) {
+        if (rw == READ)
+            down(&inode->i_sem);
+        err = lab4fs_unpack_inode(inode, 1);
+        if (rw == READ)
+            up(&inode->i_sem);
+        if (!err)
+            err = filemap_write_and_wait(file->f_mapping);
+        if (err)
+            return err;
+    }
 	return blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
 				offset, nr_segs, lab4fs_get_blocks, NULL);
 }
@@ -696,17 +1650,51 @@ lab4fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
 static int
 lab4fs_writepages(struct address_space *mapping, struct writeback_control *wbc)
 {
+    /*
+     * Pages may be redirtied with delayed buffers after the range is
+     * mapped, so regular files go through lab4fs_writepage, which maps
+     * them before the I/O.
+     */
+    if (S_ISREG(mapping->host->i_mode)) {
+        if (LAB4FS_I(mapping->host)->i_delayed_blocks)
+            lab4fs_map_delayed_range(mapping);
+        return mpage_writepages(mapping, wbc, NULL);
+    }
 	return mpage_writepages(mapping, wbc, lab4fs_get_block);
 }
 
+/* Pages cut off by truncate give back the blocks they had reserved */
+static int lab4fs_invalidatepage(struct page *page, unsigned long offset)
+{
+    struct buffer_head *head, *bh;
+    unsigned long curr = 0;
+    int nr = 0;
+
+    if (page_has_buffers(page)) {
+        head = bh = page_buffers(page);
+        do {
+            if (curr >= offset && buffer_delay(bh)) {
+                clear_buffer_delay(bh);
+                nr++;
+            }
+            curr += bh->b_size;
+            bh = bh->b_this_page;
+        } while (bh != head);
+        if (nr)
+            lab4fs_release_delayed(page->mapping->host, nr, 0);
+    }
+    return block_invalidatepage(page, offset);
+}
+
 struct address_space_operations lab4fs_aops = {
 	.readpage		= lab4fs_readpage,
 	.readpages		= lab4fs_readpages,
 	.writepage		= lab4fs_writepage,
 	.sync_page		= block_sync_page,
 	.prepare_write		= lab4fs_prepare_write,
-	.commit_write		= generic_commit_write,
+	.commit_write		= lab4fs_commit_write,
 	.bmap			= lab4fs_bmap,
+	.invalidatepage		= lab4fs_invalidatepage,
 	.direct_IO		= lab4fs_direct_IO,
 	.writepages		= lab4fs_writepages,
 };
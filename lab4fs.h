@@ -5,6 +5,7 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/init.h>
 #include <linux/blkdev.h>
 #include <linux/parser.h>
@@ -13,11 +14,15 @@
 #include <linux/smp_lock.h>
 #include <linux/vfs.h>
 #include <asm/uaccess.h>
+#include <asm/unaligned.h>
 #include <linux/fs.h>
 #include <linux/pagemap.h>
 #include <linux/version.h>
 #include <asm/bitops.h>
+#include <linux/bitmap.h>
 #include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/percpu_counter.h>
 
 /*      
  * Ext2 directory file types.  Only the low 3 bits are used.  The
@@ -51,18 +56,22 @@
 #define LAB4FS_DEF_RESUID	0
 #define LAB4FS_DEF_RESGID	0
 
-/* 7 direct blocks; 1 indirect block */
-#define lab4fs_max_size(x)	(7 * 1024 + (1024/4) * 1024)
-
+/*
+ * 7 direct blocks, then a single, a double and a triple indirect block.
+ * On disk the first two kinds are in i_block, the other two come after
+ * i_flags; in memory they are all in i_block.
+ */
 #define LAB4FS_NDIR_BLOCKS  7
 #define LAB4FS_IND_BLOCK    7
-#define LAB4FS_N_BLOCKS     8
+#define LAB4FS_DIND_BLOCK   8
+#define LAB4FS_TIND_BLOCK   9
+#define LAB4FS_N_BLOCKS     10
 #define LAB4FS_LINK_MAX     32000
 
 #define LAB4FS_BLOCK_SIZE(s)		((s)->s_blocksize)
 
 #define	LAB4FS_ADDR_PER_BLOCK(s)		(LAB4FS_BLOCK_SIZE(s) / sizeof (__u32))
-#define LAB4FS_ADDR_PER_BLOCK_BITS(s)   4
+#define LAB4FS_ADDR_PER_BLOCK_BITS(s)   (LAB4FS_SB(s)->s_log_block_size - 2)
 
 #define LAB4FS_SUPER_MAGIC	0x1ab4f5 /* lab4fs */
 
@@ -83,6 +92,20 @@
 #define LAB4DEBUG(string, args...)
 #endif
 
+/* Mount options */
+#define LAB4FS_MOUNT_EXTENTS    0x0001  /* new regular files use extents */
+#define LAB4FS_MOUNT_INLINE_DATA 0x0002 /* new regular files start inline */
+#define LAB4FS_MOUNT_TAIL       0x0004  /* pack small files in fragments */
+#define LAB4FS_MOUNT_DIR_INDEX  0x0008  /* index directories as they grow */
+#define LAB4FS_MOUNT_NAME_CACHE 0x0010  /* hash names of big directories */
+
+#define clear_opt(o, opt)   o &= ~LAB4FS_MOUNT_##opt
+#define set_opt(o, opt)     o |= LAB4FS_MOUNT_##opt
+#define test_opt(sb, opt)   (LAB4FS_SB(sb)->s_mount_opt & LAB4FS_MOUNT_##opt)
+
+/* ioctl on a directory: pack its entries and give back the blocks freed */
+#define LAB4FS_IOC_COMPACT_DIR  _IO('l', 1)
+
 #define LAB4FS_FIRST_INO(s)   (LAB4FS_SB(s)->s_first_ino)
 #define LAB4FS_INODE_SIZE(s)   (LAB4FS_SB(s)->s_inode_size)
 
@@ -108,8 +131,55 @@ struct lab4fs_super_block {
 
 	__le32 s_free_inodes_count;
 	__le32 s_free_data_blocks_count;
+
+    /* Only meaningful with LAB4FS_FEATURE_INCOMPAT_GROUPS */
+    __le32 s_feature_incompat;
+    __le32 s_blocks_per_group;
+    __le32 s_inodes_per_group;
+    __le32 s_group_desc;    /* first block of the group descriptors */
 };
 
+/*
+ * Without the GROUPS feature the fs has the original flat layout: one
+ * inode bitmap, one data bitmap, one inode table, then all the data.
+ *
+ * With it, the blocks from s_data_blocks on are cut into groups of
+ * s_blocks_per_group blocks.  Every group starts with its data bitmap,
+ * its inode bitmap and its slice of the inode table, as found in the
+ * group's descriptor, and the data bitmap covers every block of the
+ * group, the metadata ones included.  Inode ino lives in group
+ * ino / s_inodes_per_group.
+ */
+#define LAB4FS_FEATURE_INCOMPAT_GROUPS  0x0001
+#define LAB4FS_FEATURE_INCOMPAT_EXTENTS 0x0002  /* some inodes have extents */
+#define LAB4FS_FEATURE_INCOMPAT_INLINE_DATA 0x0004 /* some files are inline */
+#define LAB4FS_FEATURE_INCOMPAT_TAIL    0x0008  /* fragment blocks, tail.c */
+#define LAB4FS_FEATURE_INCOMPAT_DIR_INDEX 0x0010 /* hashed directories */
+#define LAB4FS_FEATURE_INCOMPAT_DIRHASH 0x0020  /* dirent v2 directories */
+#define LAB4FS_FEATURE_INCOMPAT_SUPP    (LAB4FS_FEATURE_INCOMPAT_GROUPS | \
+                                         LAB4FS_FEATURE_INCOMPAT_EXTENTS | \
+                                         LAB4FS_FEATURE_INCOMPAT_INLINE_DATA | \
+                                         LAB4FS_FEATURE_INCOMPAT_TAIL | \
+                                         LAB4FS_FEATURE_INCOMPAT_DIR_INDEX | \
+                                         LAB4FS_FEATURE_INCOMPAT_DIRHASH)
+
+#define LAB4FS_HAS_INCOMPAT_FEATURE(sb, mask) \
+    (LAB4FS_SB(sb)->s_sb->s_feature_incompat & cpu_to_le32(mask))
+
+struct lab4fs_group_desc {
+	__le32	bg_block_bitmap;
+	__le32	bg_inode_bitmap;
+	__le32	bg_inode_table;
+	__le16	bg_free_blocks_count;
+	__le16	bg_free_inodes_count;
+	__le16	bg_used_dirs_count;
+	__le16	bg_pad;
+	__le32	bg_reserved[4];
+};
+
+#define LAB4FS_DESC_PER_BLOCK(s) \
+    (LAB4FS_BLOCK_SIZE(s) / sizeof(struct lab4fs_group_desc))
+
 struct lab4fs_inode {
 	__le16	i_mode;		/* File mode */
 	__le16	i_links_count;	/* Links count */
@@ -121,18 +191,159 @@ struct lab4fs_inode {
 	__le32  i_gid;		/* Low 16 bits of Group Id */
 	__le32  i_uid;		/* Low 16 bits of Owner Uid */
 	__le32	i_blocks;	/* Blocks count */
-	__le32	i_block[LAB4FS_N_BLOCKS];/* Pointers to blocks */
+	__le32	i_block[LAB4FS_IND_BLOCK + 1];/* Pointers to blocks */
 	__le32	i_file_acl;	/* File ACL */
-	__le32	i_dir_acl;	/* Directory ACL */
+	__le32	i_dir_acl;	/* Directory ACL, high 32 bits of i_size for files */
+	__le32	i_flags;	/* LAB4FS_*_FL */
+	__le32	i_dind_block;	/* i_block[LAB4FS_DIND_BLOCK] in memory */
+	__le32	i_tind_block;	/* i_block[LAB4FS_TIND_BLOCK] in memory */
+};
+
+/* i_block holds the root of an extent tree, see extents.c */
+#define LAB4FS_EXTENTS_FL   0x00000001
+/*
+ * i_block, i_dind_block and i_tind_block hold the data of the file,
+ * which has no blocks.  In memory that is all of i_block.
+ */
+#define LAB4FS_INLINE_DATA_FL   0x00000002
+#define LAB4FS_INLINE_SIZE  (LAB4FS_N_BLOCKS * sizeof(__le32))
+/* The data is in fragments of a block shared with other files, see tail.c */
+#define LAB4FS_TAIL_FL      0x00000004
+/* The directory has a hashed index, see index.c */
+#define LAB4FS_INDEX_FL     0x00000008
+/* Every entry of the directory is v2, see lab4fs_name_key */
+#define LAB4FS_DIRHASH_FL   0x00000010
+/* No block of the file's own: only page 0 has data */
+#define LAB4FS_PACKED_FL    (LAB4FS_INLINE_DATA_FL | LAB4FS_TAIL_FL)
+
+#define LAB4FS_FRAG_BITS    6
+#define LAB4FS_FRAG_SIZE    (1 << LAB4FS_FRAG_BITS)
+#define LAB4FS_FRAGS_PER_BLOCK(s) \
+    min_t(int, LAB4FS_BLOCK_SIZE(s) >> LAB4FS_FRAG_BITS, 64)
+/* Bigger files would not save a fragment over having their own block */
+#define LAB4FS_TAIL_MAX(s) \
+    ((LAB4FS_FRAGS_PER_BLOCK(s) - 2) << LAB4FS_FRAG_BITS)
+#define LAB4FS_FRAG_MAGIC   0xf4a6
+
+/* In the first fragment of a fragment block */
+struct lab4fs_frag_header {
+	__le16	fh_magic;
+	__le16	fh_pad;
+	__le32	fh_map[2];	/* fragments in use */
+};
+
+/*
+ * An extent tree node: this header, then eh_entries entries of 12 bytes,
+ * extents in the leaves (eh_depth 0) and index entries above them, each
+ * sorted by first logical block.  The root lives in i_block.
+ */
+#define LAB4FS_EXT_MAGIC    0xf34a
+
+struct lab4fs_extent_header {
+	__le16	eh_magic;
+	__le16	eh_entries;
+	__le16	eh_max;
+	__le16	eh_depth;
+};
+
+struct lab4fs_extent {
+	__le32	ee_block;	/* first logical block */
+	__le32	ee_start;	/* first physical block */
+	__le16	ee_len;
+	__le16	ee_pad;
+};
+
+struct lab4fs_extent_idx {
+	__le32	ei_block;	/* lowest logical block below this entry */
+	__le32	ei_leaf;	/* node one level down */
+	__le32	ei_pad;
 };
 
+/*
+ * One on-disk block of a bitmap, locked independently of the others.
+ * The buffer is only read in when the block is first used, and may be
+ * dropped again when the bitmap cache is full; see bitmap_get_block.
+ */
+struct lab4fs_bitmap_block {
+    spinlock_t lock;
+    int nr_free;        /* zero bits in this block, protected by lock */
+    int counted;        /* nr_free was counted from the data itself */
+    __u32 blocknr;      /* where the block lives on disk */
+    struct buffer_head *bh;     /* NULL when not cached */
+    struct list_head lru;
+};
+
+/*
+ * Tells bitmap_setup where bitmap block n lives and, in *nr_free, how
+ * many zero bits it is believed to have, or -1 if that is not known.
+ */
+typedef __u32 (*lab4fs_bitmap_locate_t)(struct super_block *sb, int n,
+        int *nr_free);
+
+/*
+ * Free bits are summarized at two levels: nr_free of every bitmap block,
+ * and summary[] which counts the free bits of each run of
+ * LAB4FS_BITMAP_SUMMARY_SPAN blocks.  Searches skip full runs and full
+ * blocks without looking at the bitmap data.  Until a block is read its
+ * nr_free is the figure given at setup, or 1 if there was none, so
+ * that its run is never skipped; it is made exact on the first read.
+ */
+#define LAB4FS_BITMAP_SUMMARY_SHIFT 5
+#define LAB4FS_BITMAP_SUMMARY_SPAN  (1 << LAB4FS_BITMAP_SUMMARY_SHIFT)
+
+/* How many buffers of one bitmap are kept pinned at most */
+#define LAB4FS_BITMAP_MAX_CACHED    64
+
 struct lab4fs_bitmap {
     int nr_bhs;
-    rwlock_t rwlock;
     int nr_valid_bits;
     __u32 log_nr_bits_per_block;
     __u32 nr_bits_per_block;
-    struct buffer_head **bhs;
+    struct lab4fs_bitmap_block *blocks;
+    int nr_summary;
+    atomic_t *summary;
+    struct super_block *sb;
+    spinlock_t lru_lock;        /* protects lru, nr_cached and blocks[].bh */
+    struct list_head lru;       /* cached blocks, least recently used first */
+    int nr_cached;
+};
+
+/*
+ * Reservation window of a file being written, see balloc.c.
+ * Bounds are data bitmap bits, both inclusive.
+ */
+#define LAB4FS_RSV_NONE             0xffffffff
+#define LAB4FS_DEFAULT_RSV_BLOCKS   8
+#define LAB4FS_MAX_RSV_BLOCKS       1024
+
+struct lab4fs_reserve_window {
+    __u32 rsv_start;
+    __u32 rsv_end;
+    __u32 rsv_goal_size;
+    struct rb_node rsv_node;
+};
+
+/* Blocks being freed in runs, see lab4fs_free_batch_add */
+struct lab4fs_free_batch {
+    struct inode *inode;
+    __u32 block;            /* run not cleared yet */
+    unsigned long count;
+    unsigned long nr;       /* blocks handed in */
+    long freed;             /* cleared, not yet in the free counter */
+};
+
+/*
+ * Inode numbers a CPU has claimed ahead of time, all from one group;
+ * see ialloc.c.
+ */
+#define LAB4FS_INO_BATCH    16
+
+struct lab4fs_ino_batch {
+    spinlock_t lock;
+    int group;
+    int next;           /* ino[next] .. ino[nr - 1] are still free */
+    int nr;
+    __u32 ino[LAB4FS_INO_BATCH];
 };
 
 struct lab4fs_sb_info {
@@ -147,14 +358,44 @@ struct lab4fs_sb_info {
     __u32 s_root_inode;
 	__u32 s_inode_table;
 	__u32 s_data_blocks;
+    unsigned long s_mount_opt;
+    unsigned long s_groups_count;
+    __u32 s_blocks_per_group;
+    __u32 s_inodes_per_group;
+    unsigned s_inodes_per_block;
+    unsigned s_desc_per_block;
+    unsigned long s_gdb_count;  /* blocks of group descriptors */
+    struct buffer_head **s_group_desc;
+    spinlock_t s_group_lock;    /* protects bg_used_dirs_count */
 	rwlock_t rwlock;
-    __u32 s_next_generation;
-	__u32 s_free_inodes_count;
-	__u32 s_free_data_blocks_count;
+    atomic_t s_next_generation;
+    struct lab4fs_ino_batch *s_ino_batch;   /* per CPU */
+    /* Free counts, folded into the on-disk superblock by write_super */
+    struct percpu_counter s_free_inodes_counter;
+    struct percpu_counter s_free_data_blocks_counter;
+    /* blocks promised to delayed writes, still free in the bitmap */
+    struct percpu_counter s_delayed_blocks_counter;
     struct lab4fs_bitmap s_inode_bitmap;
     struct lab4fs_bitmap s_data_bitmap;
+    /* protects fragment maps; s_frag_block is the last one seen with room */
+    struct semaphore s_frag_sem;
+    __u32 s_frag_block;
+    spinlock_t s_rsv_window_lock;
+    struct rb_root s_rsv_window_root;
 };
 
+struct lab4fs_name_cache;
+
+#define LAB4FS_DIR_LIVE_UNKNOWN     (~0U)
+/*
+ * Deleting from a directory of at least LAB4FS_COMPACT_MIN_BLOCKS blocks
+ * compacts it once no more than 1/LAB4FS_COMPACT_RATIO of it is in use:
+ * at once if nobody has it open, otherwise on the last close, so that
+ * no readdir is under way while the records move.
+ */
+#define LAB4FS_COMPACT_MIN_BLOCKS   8
+#define LAB4FS_COMPACT_RATIO        4
+
 struct lab4fs_inode_info {
 	__u16	i_mode;		/* File mode */
 	__u16	i_links_count;	/* Links count */
@@ -169,12 +410,72 @@ struct lab4fs_inode_info {
 	__le32	i_block[LAB4FS_N_BLOCKS];/* Pointers to blocks */
 	__u32	i_file_acl;	/* File ACL */
 	__u32	i_dir_acl;	/* Directory ACL */
+	__u32	i_flags;
+    /* serializes extent tree lookups against changes */
+    struct rw_semaphore i_ext_sem;
     unsigned i_dir_start_lookup;
+    __u32   i_dir_live;     /* bytes of live records, under i_sem */
+    atomic_t i_dir_opens;   /* open files of the directory */
+    int     i_dir_compact;  /* compact on the last close, under i_sem */
+    /* room in each block, see lab4fs_free_map_find; under i_sem */
+    __u16   *i_dir_free;
+    unsigned i_dir_free_size;
+    unsigned i_dir_free_first;
+    struct lab4fs_name_cache *i_name_cache;     /* see namecache.c */
+    /* logical block and physical block of the last allocation */
+    __u32   i_next_alloc_block;
+    __u32   i_next_alloc_goal;
+    struct lab4fs_reserve_window i_rsv_window;
+    /* blocks claimed ahead for the rest of a page, under rwlock */
+    __u32   i_prealloc_block;
+    __u32   i_prealloc_count;
+    /* how many of those stand in for delayed blocks, see lab4fs_map_delayed */
+    __u32   i_prealloc_delayed;
+    /* blocks reserved for delayed writes and not yet allocated, under rwlock */
+    __u32   i_delayed_blocks;
+    __u32   i_delayed_meta;
+    sector_t i_delayed_meta_leaf;   /* first block of the last leaf reserved */
+    /* last run found by lab4fs_map_block, under rwlock; empty if len is 0 */
+    __u32   i_map_lblock;
+    __u32   i_map_pblock;
+    __u32   i_map_len;
+    unsigned i_map_gen;     /* bumped on every invalidation */
     rwlock_t rwlock;
     struct inode vfs_inode;
     struct buffer_head *bh;
 };
 
+/*
+ * Whether a free counter is above zero.  The cheap per-CPU estimate is
+ * trusted while it is far from zero, the exact sum is only taken when
+ * space is about to run out.
+ */
+static inline int lab4fs_counter_positive(struct percpu_counter *fbc)
+{
+    if (percpu_counter_read_positive(fbc) > FBC_BATCH * num_online_cpus())
+        return 1;
+    return percpu_counter_sum(fbc) > 0;
+}
+
+/* Whether n data blocks are free and not promised to delayed writes */
+static inline int lab4fs_has_free_blocks(struct lab4fs_sb_info *sbi, long n)
+{
+    long free = percpu_counter_read_positive(&sbi->s_free_data_blocks_counter);
+    long delayed = percpu_counter_read_positive(&sbi->s_delayed_blocks_counter);
+
+    if (free - delayed > n + 2 * FBC_BATCH * num_online_cpus())
+        return 1;
+    free = percpu_counter_sum(&sbi->s_free_data_blocks_counter);
+    delayed = percpu_counter_sum(&sbi->s_delayed_blocks_counter);
+    return free - delayed >= n;
+}
+
+/*
+ * A buffer written with delayed allocation is mapped to this block
+ * until writeback gives it a real one.
+ */
+#define LAB4FS_DELAYED_BLOCK    (~(sector_t)0)
+
 #define LAB4FS_NAME_LEN     255
 
 struct lab4fs_dir_entry {
@@ -185,6 +486,84 @@ struct lab4fs_dir_entry {
 	char	name[LAB4FS_NAME_LEN];	/* File name */
 };
 
+/* Compare two names a word at a time, neither need be aligned */
+static inline int lab4fs_name_eq(const char *a, const char *b, int len)
+{
+    while (len >= sizeof(unsigned long)) {
+        if (get_unaligned((unsigned long *)a) !=
+                get_unaligned((unsigned long *)b))
+            return 0;
+        a += sizeof(unsigned long);
+        b += sizeof(unsigned long);
+        len -= sizeof(unsigned long);
+    }
+    while (len--)
+        if (*a++ != *b++)
+            return 0;
+    return 1;
+}
+
+static inline int lab4fs_match(int len, const char *const name,
+        struct lab4fs_dir_entry *de)
+{
+    if (len != de->name_len)
+        return 0;
+    if (!de->inode)
+        return 0;
+    return lab4fs_name_eq(name, de->name, len);
+}
+
+static inline struct lab4fs_dir_entry *
+lab4fs_next_entry(struct lab4fs_dir_entry *p)
+{
+    return (struct lab4fs_dir_entry *)
+        ((char *)p + le16_to_cpu(p->rec_len));
+}
+
+static inline int lab4fs_is_dot(const char *name, int len)
+{
+    return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+static inline void lab4fs_put_page(struct page *page)
+{
+	kunmap(page);
+	page_cache_release(page);
+}
+
+/*
+ * Hashed directory index.  Block 0 of an indexed directory holds "."
+ * and "..", whose record covers the rest of the block, then struct
+ * lab4fs_dx_root_info and the root's array of lab4fs_dx_entry.  With
+ * indirect_levels 1 the root entries point to node blocks, which start
+ * with an unused record covering the whole block and go on with an
+ * array of their own.  The entries of the last level point to leaves,
+ * plain directory blocks with the names hashing from their hash up to
+ * the next entry's.  The first entry of an array has the count and
+ * limit of the array in place of a hash.
+ */
+struct lab4fs_dx_root_info {
+	__le32	reserved_zero;
+	__u8	hash_version;	/* LAB4FS_HASH_VERSION */
+	__u8	info_length;	/* 8 */
+	__u8	indirect_levels;
+	__u8	unused_flags;
+};
+
+struct lab4fs_dx_entry {
+	__le32	hash;
+	__le32	block;
+};
+
+struct lab4fs_dx_countlimit {
+	__le16	limit;
+	__le16	count;
+};
+
+#define LAB4FS_HASH_VERSION 1
+/* Bigger directories are left linear by lab4fs_dx_build */
+#define LAB4FS_DX_BUILD_BLOCKS  16
+
 #ifdef CONFIG_LAB4FS_DEBUG
 void print_buffer_head(struct buffer_head *bh, int start, int len);
 void print_raw_inode(struct lab4fs_inode *raw_inode);
@@ -215,24 +594,156 @@ void lab4fs_read_inode(struct inode *inode);
 int lab4fs_write_inode(struct inode *inode, int wait);
 int lab4fs_sync_inode(struct inode *inode);
 void lab4fs_delete_inode (struct inode * inode);
+void lab4fs_truncate(struct inode *inode);
 struct inode *lab4fs_new_inode(struct inode *dir, int mode);
 
+int lab4fs_init_ino_batches(struct super_block *sb);
+void lab4fs_destroy_ino_batches(struct super_block *sb);
+ino_t lab4fs_alloc_ino(struct inode *dir, int mode);
+void lab4fs_free_ino(struct super_block *sb, ino_t ino, int mode);
+
+struct lab4fs_group_desc *lab4fs_get_group_desc(struct super_block *sb,
+        unsigned int group, struct buffer_head **bh);
+__u32 lab4fs_alloc_blocks(struct inode *inode, __u32 perfered,
+        unsigned long *count, long *err);
+__u32 lab4fs_alloc_data_block(struct inode *inode, __u32 perfered, long *err);
+void lab4fs_free_blocks(struct inode *inode, __u32 block, unsigned long count);
+void lab4fs_free_batch_init(struct lab4fs_free_batch *fb, struct inode *inode);
+void lab4fs_free_batch_add(struct lab4fs_free_batch *fb, __u32 block,
+        unsigned long count);
+void lab4fs_free_batch_end(struct lab4fs_free_batch *fb);
+void lab4fs_discard_reservation(struct inode *inode);
+void lab4fs_discard_prealloc(struct inode *inode);
+__u32 lab4fs_use_prealloc(struct inode *inode, __u32 goal);
+int lab4fs_reserve_delayed(struct inode *inode, int meta);
+void lab4fs_release_delayed(struct inode *inode, int nr, int meta);
+
+__u32 lab4fs_inode_goal(struct inode *inode);
+void lab4fs_readahead_indirect(struct inode *inode);
+unsigned lab4fs_map_cache_gen(struct inode *inode);
+void lab4fs_map_cache_set(struct inode *inode, unsigned gen,
+        __u32 lblock, __u32 pblock, __u32 len);
+void lab4fs_map_cache_invalidate(struct inode *inode);
+
+int lab4fs_tail_alloc(struct inode *inode, const char *data, unsigned len);
+void lab4fs_tail_free(struct inode *inode, __le32 *i_block);
+unsigned lab4fs_tail_room(struct inode *inode);
+int lab4fs_tail_read(struct inode *inode, char *data, unsigned len);
+int lab4fs_tail_write(struct inode *inode, const char *data, unsigned len);
+
+void lab4fs_ext_tree_init(struct inode *inode);
+void lab4fs_ext_readahead(struct inode *inode);
+int lab4fs_ext_get_block(struct inode *inode, sector_t iblock,
+        struct buffer_head *bh_result, int create, int want, int maxblocks);
+int lab4fs_ext_missing_meta(struct inode *inode, sector_t iblock,
+        sector_t *leaf);
+void lab4fs_ext_truncate(struct inode *inode, __u32 from,
+        struct lab4fs_free_batch *fb);
+
 int lab4fs_permission(struct inode *inode, int mask, struct nameidata *nd);
 int lab4fs_setattr(struct dentry *dentry, struct iattr *iattr);
 int lab4fs_add_link(struct dentry *dentry, struct inode *inode);
+struct page *lab4fs_get_page(struct inode *dir, unsigned long n);
+unsigned long lab4fs_dir_readahead(struct inode *dir, unsigned long n,
+        unsigned long ra);
+int lab4fs_commit_chunk(struct page *page, unsigned from, unsigned to);
+int lab4fs_write_dir_block(struct inode *dir, unsigned long b, char *data);
+int lab4fs_sync_dir_blocks(struct inode *dir, unsigned long from,
+        unsigned long to);
+int lab4fs_dir_compact(struct inode *dir, int sparse_only);
+void lab4fs_free_map_drop(struct inode *dir);
+int lab4fs_insert_entry(struct page *page, struct lab4fs_dir_entry *de,
+        const char *name, int namelen, struct inode *inode);
 struct lab4fs_dir_entry * lab4fs_find_entry (struct inode * dir,
 			struct dentry *dentry, struct page ** res_page);
 ino_t lab4fs_inode_by_name(struct inode *dir, struct dentry *dentry);
 struct dentry *lab4fs_get_parent(struct dentry *child);
 
+__u32 lab4fs_dirhash(const char *name, int len);
+int lab4fs_dx_find_entry(struct inode *dir, const char *name, int namelen,
+        struct lab4fs_dir_entry **res_dir, struct page **res_page);
+int lab4fs_dx_add_link(struct dentry *dentry, struct inode *inode);
+int lab4fs_dx_build(struct inode *dir);
+
+/*
+ * Dirent v2, in directories with LAB4FS_DIRHASH_FL: file_type only
+ * needs its low 3 bits, the other 5 hold the top bits of the hash of
+ * the name.  A scan compares name_len and these bits as one 16-bit
+ * word, and only reads the names that pass.
+ */
+#define LAB4FS_FT_MASK      0x07
+#define LAB4FS_DE_TAG_MASK  0xf8
+
+struct lab4fs_name_key {
+    __le16 key;         /* name_len and file_type as they must read */
+    __le16 mask;        /* the bits of them that matter */
+};
+
+static inline __u8 lab4fs_name_tag(const char *name, int len)
+{
+    return (lab4fs_dirhash(name, len) >> 24) & LAB4FS_DE_TAG_MASK;
+}
+
+/* Tag de, just filled in, if dir is v2 */
+static inline void lab4fs_set_de_tag(struct inode *dir,
+        struct lab4fs_dir_entry *de)
+{
+    if (LAB4FS_I(dir)->i_flags & LAB4FS_DIRHASH_FL)
+        de->file_type = (de->file_type & LAB4FS_FT_MASK) |
+            lab4fs_name_tag(de->name, de->name_len);
+}
+
+static inline struct lab4fs_name_key
+lab4fs_name_key(struct inode *dir, const char *name, int len)
+{
+    struct lab4fs_name_key k;
+    __u16 key = len, mask = 0xff;
+
+    if (LAB4FS_I(dir)->i_flags & LAB4FS_DIRHASH_FL) {
+        key |= lab4fs_name_tag(name, len) << 8;
+        mask |= LAB4FS_DE_TAG_MASK << 8;
+    }
+    k.key = cpu_to_le16(key);
+    k.mask = cpu_to_le16(mask);
+    return k;
+}
+
+/* lab4fs_match, rejecting most other names on the key alone */
+static inline int lab4fs_match_key(struct lab4fs_name_key k, int len,
+        const char *name, struct lab4fs_dir_entry *de)
+{
+    if ((*(__le16 *)&de->name_len & k.mask) != k.key)
+        return 0;
+    if (!de->inode)
+        return 0;
+    return lab4fs_name_eq(name, de->name, len);
+}
+
+int lab4fs_name_cache_init(void);
+void lab4fs_name_cache_exit(void);
+int lab4fs_name_cache_find(struct inode *dir, const char *name, int namelen,
+        struct lab4fs_dir_entry **res_dir, struct page **res_page);
+void lab4fs_name_cache_add(struct inode *dir, const char *name, int namelen,
+        __u32 pos);
+void lab4fs_name_cache_remove(struct inode *dir, const char *name,
+        int namelen, __u32 pos);
+void lab4fs_name_cache_drop(struct inode *dir);
+
 int bitmap_setup(struct lab4fs_bitmap *bitmap, struct super_block *sb,
-        __u32 start_block);
+        __u32 bits_per_block, lab4fs_bitmap_locate_t locate);
+void bitmap_destroy(struct lab4fs_bitmap *bitmap);
 void bitmap_set_bit(struct lab4fs_bitmap *bitmap, int nr);
 int bitmap_test_and_set_bit(struct lab4fs_bitmap *bitmap, int nr);
 void bitmap_clear_bit(struct lab4fs_bitmap *bitmap, int nr);
 int bitmap_test_and_clear_bit(struct lab4fs_bitmap *bitmap, int nr);
 int bitmap_test_bit(struct lab4fs_bitmap *bitmap, int nr);
+__u32 bitmap_find_zero_bit_range(struct lab4fs_bitmap *bitmap, int off,
+        int end, int set);
 __u32 bitmap_find_next_zero_bit(struct lab4fs_bitmap *bitmap, int off, int set);
+int bitmap_claim_zero_run(struct lab4fs_bitmap *bitmap, int off, int end,
+        int max, __u32 *start);
+int bitmap_clear_run(struct lab4fs_bitmap *bitmap, int nr, int count);
+int bitmap_nr_free(struct lab4fs_bitmap *bitmap);
 
 #endif
 
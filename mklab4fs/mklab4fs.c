@@ -79,10 +79,19 @@
 
 #define LAB4FS_MAGIC    0x1ab4f5
 
+#define LAB4FS_FEATURE_INCOMPAT_GROUPS  0x0001
+#define LAB4FS_FEATURE_INCOMPAT_DIRHASH 0x0020  /* dirent v2 directories */
+#define LAB4FS_DIRHASH_FL   0x00000010
+#define LAB4FS_FT_MASK      0x07
+#define LAB4FS_DE_TAG_MASK  0xf8
+#define GROUP_DESC_SIZE     32
+
 #define VERBOSE(string, args...)  do {\
     if (verbose) printf(string, ##args); \
 } while (0)
 
+#define MIN(x, y)   ((x) < (y) ? (x) : (y))
+
 #define INODESIZE   128
 #define NR_BLKS_PER_FILE    1.0
 
@@ -98,7 +107,7 @@
 #define LAB4FS_FIRST_INO    2
 
 #define LAB4FS_NDIR_BLOCKS  7
-#define LAB4FS_IND_BLOCKS   8
+#define LAB4FS_IND_BLOCK    7
 #define LAB4FS_N_BLOCKS     8
 
 #define __le32 uint32_t
@@ -107,9 +116,25 @@
 
 static int verbose = 1;
 
+/*
+ * A block group: its data bitmap, inode bitmap and inode table come
+ * first, then data.  The data bitmap covers the whole group.
+ */
+struct lab4fs_group {
+    uint32_t first_block;
+    uint32_t nr_blocks;
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t used_dirs_count;
+};
+
 /*
  * first 1024B: MBR + Other stuff
  * 1024 ~ 2048: Super block
+ * then the group descriptors, then the groups
  */
 struct lab4fs_sb_info {
     uint32_t magic;
@@ -126,6 +151,15 @@ struct lab4fs_sb_info {
     uint32_t first_inode;
     uint32_t free_inode_count;
     uint32_t free_data_block_count;
+    uint32_t feature_incompat;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t group_desc_block;
+
+    /* Not written to disk as such */
+    uint32_t groups_count;
+    uint32_t inode_table_blocks;
+    struct lab4fs_group *groups;
 };
 
 struct lab4fs_inode {
@@ -142,6 +176,9 @@ struct lab4fs_inode {
 	__le32	i_block[LAB4FS_N_BLOCKS];/* Pointers to blocks */
 	__le32	i_file_acl;	/* File ACL */
 	__le32	i_dir_acl;	/* Directory ACL */
+	__le32	i_flags;
+	__le32	i_dind_block;	/* Double indirect block */
+	__le32	i_tind_block;	/* Triple indirect block */
 };
 
 #define LAB4FS_NAME_LEN     255
@@ -154,36 +191,39 @@ struct lab4fs_dir_entry {
 	char	name[LAB4FS_NAME_LEN];	/* File name */
 };
 
-/* Copy from kernel */
+/* Copy from kernel, on 32-bit words so it works on 64-bit hosts too */
 int set_bit(int nr,long * addr)
 {
+    uint32_t *p = (uint32_t *)addr;
     int mask, retval;
 
-    addr += nr >> 5;
+    p += nr >> 5;
     mask = 1 << (nr & 0x1f);
-    retval = (mask & *addr) != 0;
-    *addr |= mask;
+    retval = (mask & *p) != 0;
+    *p |= mask;
     return retval;
 }
 
 int clear_bit(int nr, long * addr)
 {
+    uint32_t *p = (uint32_t *)addr;
     int mask, retval;
 
-    addr += nr >> 5;
+    p += nr >> 5;
     mask = 1 << (nr & 0x1f);
-    retval = (mask & *addr) != 0;
-    *addr &= ~mask;
+    retval = (mask & *p) != 0;
+    *p &= ~mask;
     return retval;
 }
 
 int test_bit(int nr, const unsigned long * addr)
 {
+    const uint32_t *p = (const uint32_t *)addr;
     int mask;
 
-    addr += nr >> 5;
+    p += nr >> 5;
     mask = 1 << (nr & 0x1f);
-    return ((mask & *addr) != 0); 
+    return ((mask & *p) != 0); 
 }
 
 /* Well... Nothing but rename... */
@@ -222,6 +262,7 @@ int total_space(char *filename, unsigned long *nr_blks, unsigned long *blk_size)
 struct lab4fs_sb_info *get_sb(unsigned long nr_blks, unsigned long blk_size)
 {
     struct lab4fs_sb_info *sb;
+    struct lab4fs_group *gp;
     uint32_t i, j;
     double d;
 
@@ -229,17 +270,24 @@ struct lab4fs_sb_info *get_sb(unsigned long nr_blks, unsigned long blk_size)
     memset(sb, 0, sizeof(struct lab4fs_sb_info));
     sb->magic = LAB4FS_MAGIC;
     sb->block_size = blk_size;
-    sb->block_count = nr_blks;
+    sb->feature_incompat = LAB4FS_FEATURE_INCOMPAT_GROUPS;
+    sb->blocks_per_group = blk_size << 3;
 
     /* First available block. */
     i = 2048 / blk_size;
     i += (2048 % blk_size? 1 : 0); 
     sb->first_available_block = i;
-
-    sb->first_inode_bitmap_block = sb->first_available_block;
-
-    /* Number of blocks for inode bitmap, inode and data */
-    j = nr_blks - sb->first_available_block;
+    sb->group_desc_block = sb->first_available_block;
+
+    /* The group descriptors go first, then the groups */
+    i = (nr_blks - sb->first_available_block + sb->blocks_per_group - 1)
+        / sb->blocks_per_group;
+    j = (i * GROUP_DESC_SIZE + blk_size - 1) / blk_size;
+    sb->first_data_block = sb->group_desc_block + j;
+    if (nr_blks <= sb->first_data_block)
+        return NULL;
+    sb->groups_count = (nr_blks - sb->first_data_block + sb->blocks_per_group - 1)
+        / sb->blocks_per_group;
 
     /* 
      * Number of bytes per file, including:
@@ -247,48 +295,55 @@ struct lab4fs_sb_info *get_sb(unsigned long nr_blks, unsigned long blk_size)
      *  INODESIZE bytes for inode;
      *  one bit in inode bitmap; 
      *  NR_BLKS_PER_FILE bits in data block bitmap
+     *
+     * Every group gets the same number of inodes, a power of 2 so the
+     * kernel can find an inode's group with a shift.
      */
     d = sb->block_size * NR_BLKS_PER_FILE + INODESIZE + 0.125 + 0.125 * NR_BLKS_PER_FILE;
+    j = MIN(sb->blocks_per_group, nr_blks - sb->first_data_block);
+    i = (j * (double)sb->block_size) / d;
+    for (sb->inodes_per_group = sb->block_size / INODESIZE;
+            sb->inodes_per_group * 2 <= i &&
+            sb->inodes_per_group * 2 <= sb->block_size << 3;
+            sb->inodes_per_group <<= 1)
+        ;
+    sb->inode_table_blocks = sb->inodes_per_group * INODESIZE / sb->block_size;
+
+    /* A last group too small for its own metadata is left out */
+    j = nr_blks - sb->first_data_block
+        - (sb->groups_count - 1) * sb->blocks_per_group;
+    if (j < sb->inode_table_blocks + 2 + 16) {
+        sb->groups_count--;
+        nr_blks = sb->first_data_block + sb->groups_count * sb->blocks_per_group;
+    }
+    if (sb->groups_count == 0)
+        return NULL;
+    sb->block_count = nr_blks;
 
-    /* 
-     * Decide how many inode we need inside this filesystem.
-     * One inode per file
-     */
-    sb->inode_count = (j * sb->block_size) / d;
-    if (j = (sb->inode_count * INODESIZE) % sb->block_size)
-        sb->inode_count += j / INODESIZE;
+    sb->groups = calloc(sb->groups_count, sizeof(struct lab4fs_group));
+    for (i = 0; i < sb->groups_count; i++) {
+        gp = &sb->groups[i];
+        gp->first_block = sb->first_data_block + i * sb->blocks_per_group;
+        gp->nr_blocks = MIN(sb->blocks_per_group, nr_blks - gp->first_block);
+        gp->block_bitmap = gp->first_block;
+        gp->inode_bitmap = gp->first_block + 1;
+        gp->inode_table = gp->first_block + 2;
+        gp->free_blocks_count = gp->nr_blocks - sb->inode_table_blocks - 2;
+        gp->free_inodes_count = sb->inodes_per_group;
+        sb->free_data_block_count += gp->free_blocks_count;
+    }
+    sb->groups[0].free_inodes_count -= LAB4FS_FIRST_INO;
 
-    /* Number of bytes for inode bitmap */
-    i = sb->inode_count >> 3;
-    sb->inode_count = i << 3;
+    sb->inode_count = sb->groups_count * sb->inodes_per_group;
     sb->free_inode_count = sb->inode_count - LAB4FS_FIRST_INO;
-
-    /* Number of blocks for inode bitmap */
-    j = (i % sb->block_size) ? 1 : 0;
-    j += (i / sb->block_size);
-    sb->first_data_bitmap_block = j + sb->first_inode_bitmap_block;
-
-    /* Number of blocks for inodes */
-    j = (sb->inode_count * INODESIZE) / sb->block_size;
-
-    /* Number of blocks for data block bitmap, inodes, and data blocks */
-    i = nr_blks - sb->first_data_bitmap_block;
-
-    /* Number of blocks for data block bitmap and data blocks */
-    i = i - j;
-
-    /* Number of blocks for data block bitmap */
-    j = i / (8 * sb->block_size + 1);
-    i = j + (i % (8 * sb->block_size + 1)) ? 1 : 0;
-
-    /* Number of blocks for inodes */
-    j = (sb->inode_count * INODESIZE) / sb->block_size;
-    sb->first_inode_block = sb->first_data_bitmap_block + i;
-    sb->first_data_block =sb->first_inode_block + j;
-    sb->free_data_block_count = nr_blks - sb->first_data_block;
+    sb->first_inode_bitmap_block = sb->groups[0].inode_bitmap;
+    sb->first_data_bitmap_block = sb->groups[0].block_bitmap;
+    sb->first_inode_block = sb->groups[0].inode_table;
     sb->inode_size = INODESIZE;
     sb->first_inode = LAB4FS_FIRST_INO;
     sb->root_inode = LAB4FS_ROOT_INO;
+    VERBOSE("%u groups of %u blocks and %u inodes\n", sb->groups_count,
+            sb->blocks_per_group, sb->inodes_per_group);
     return sb;
 }
 
@@ -361,14 +416,84 @@ int write_super_block(int fd, struct lab4fs_sb_info *sb)
     write2buf32(sb->first_inode, buf, i);
     write2buf32(sb->free_inode_count, buf, i);
     write2buf32(sb->free_data_block_count, buf, i);
+    write2buf32(sb->feature_incompat, buf, i);
+    write2buf32(sb->blocks_per_group, buf, i);
+    write2buf32(sb->inodes_per_group, buf, i);
+    write2buf32(sb->group_desc_block, buf, i);
 
     return write(fd, buf, sizeof(buf));
 }
 
+static void put_le32(uint8_t *buf, uint32_t n)
+{
+    n = htole32(n);
+    memcpy(buf, &n, 4);
+}
+
+static void put_le16(uint8_t *buf, uint16_t n)
+{
+    n = htole16(n);
+    memcpy(buf, &n, 2);
+}
+
+int write_group_descs(int fd, struct lab4fs_sb_info *sb)
+{
+    uint32_t i, n;
+    uint8_t *buf, *p;
+    struct lab4fs_group *gp;
+    int ret;
+
+    n = sb->first_data_block - sb->group_desc_block;
+    buf = malloc(n * sb->block_size);
+    memset(buf, 0, n * sb->block_size);
+    for (i = 0; i < sb->groups_count; i++) {
+        gp = &sb->groups[i];
+        p = buf + i * GROUP_DESC_SIZE;
+        put_le32(p, gp->block_bitmap);
+        put_le32(p + 4, gp->inode_bitmap);
+        put_le32(p + 8, gp->inode_table);
+        put_le16(p + 12, gp->free_blocks_count);
+        put_le16(p + 14, gp->free_inodes_count);
+        put_le16(p + 16, gp->used_dirs_count);
+    }
+    ret = write_blocks(fd, sb, sb->group_desc_block, n, buf);
+    free(buf);
+    return ret;
+}
+
+/* Empty data bitmaps, except for the metadata at the start of each group */
 int write_data_bitmap(int fd, struct lab4fs_sb_info *sb)
 {
-    return bzero_blocks(fd, sb, sb->first_data_bitmap_block,
-            sb->first_inode_block - sb->first_data_bitmap_block);
+    uint32_t i, j;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = malloc(sb->block_size);
+    for (i = 0; i < sb->groups_count; i++) {
+        memset(buf, 0, sb->block_size);
+        for (j = 0; j < sb->inode_table_blocks + 2; j++)
+            bit_set(buf, j);
+        ret = write_blocks(fd, sb, sb->groups[i].block_bitmap, 1, buf);
+        if (ret < 0)
+            break;
+    }
+    free(buf);
+    return ret;
+}
+
+/* Start with inode tables full of zeros rather than stale data */
+int write_inode_tables(int fd, struct lab4fs_sb_info *sb)
+{
+    uint32_t i;
+    int ret = 0;
+
+    for (i = 0; i < sb->groups_count; i++) {
+        ret = bzero_blocks(fd, sb, sb->groups[i].inode_table,
+                sb->inode_table_blocks);
+        if (ret < 0)
+            break;
+    }
+    return ret;
 }
 
 #define MSB_MASK    128
@@ -378,10 +503,11 @@ int write_inode_bitmap(int fd, struct lab4fs_sb_info *sb)
     int i, n, offset;
     uint8_t mask;
     uint8_t *buf;
-    i = bzero_blocks(fd, sb, sb->first_inode_bitmap_block,
-            sb->first_data_bitmap_block - sb->first_inode_bitmap_block);
-    if (i < 0)
-        return i;
+    for (n = 0; n < sb->groups_count; n++) {
+        i = bzero_blocks(fd, sb, sb->groups[n].inode_bitmap, 1);
+        if (i < 0)
+            return i;
+    }
     buf = malloc(sb->block_size);
     memset(buf, 0, sb->block_size); 
     for (i = 0; i < sb->first_inode; i++)
@@ -394,27 +520,23 @@ int write_inode_bitmap(int fd, struct lab4fs_sb_info *sb)
 void locate_inode_bit(struct lab4fs_sb_info *sb,
         uint32_t ino, uint32_t *block, uint32_t *bit)
 {
-    uint32_t i;
-    i = sb->block_size << 3;
-    *block = ino / i + sb->first_inode_bitmap_block;
-    *bit= ino % i;
+    *block = sb->groups[ino / sb->inodes_per_group].inode_bitmap;
+    *bit = ino % sb->inodes_per_group;
 }
 
 void locate_inode(struct lab4fs_sb_info *sb,
         uint32_t ino, uint32_t *block, uint32_t *offset)
 {
-    uint32_t i;
+    uint32_t i, index;
     i = sb->block_size / sb->inode_size;
-    *block = ino / i + sb->first_inode_block;
-    *offset = (ino % i) * sb->inode_size;
+    index = ino % sb->inodes_per_group;
+    *block = index / i + sb->groups[ino / sb->inodes_per_group].inode_table;
+    *offset = (index % i) * sb->inode_size;
 }
 
 void locate_datablock_bit(struct lab4fs_sb_info *sb,
         uint32_t absolute_block_num, uint32_t *block, uint32_t *bit)
 {
-    uint32_t i;
-    i = sb->block_size << 3;
-
     if (absolute_block_num < sb->first_data_block) {
         *block = 0;
         *bit = 0;
@@ -422,34 +544,31 @@ void locate_datablock_bit(struct lab4fs_sb_info *sb,
     }
     absolute_block_num = absolute_block_num - sb->first_data_block;
 
-    *block = absolute_block_num / i + sb->first_data_bitmap_block;
-    *bit = absolute_block_num % i;
+    *block = sb->groups[absolute_block_num / sb->blocks_per_group].block_bitmap;
+    *bit = absolute_block_num % sb->blocks_per_group;
 }
 
 /* Return 0 on error!!! */
 uint32_t first_free_data_block(int fd, struct lab4fs_sb_info *sb)
 {
     uint8_t *buf;
-    uint32_t offset, block;
-    uint32_t i;
+    struct lab4fs_group *gp;
+    uint32_t g, i;
 
     buf = malloc(sb->block_size);
 
-    offset = 0;
-    for (block = sb->first_data_bitmap_block;
-            block < sb->first_inode_block;
-            block++, offset += sb->block_size << 3) {
-        read_block(fd, sb, block, buf);
-        for (i = 0; i < sb->block_size << 3; i++) {
+    for (g = 0; g < sb->groups_count; g++) {
+        gp = &sb->groups[g];
+        if (!gp->free_blocks_count)
+            continue;
+        read_block(fd, sb, gp->block_bitmap, buf);
+        for (i = 0; i < gp->nr_blocks; i++) {
             if (!bit_test(buf, i)) {
-                if (i + offset + sb->first_data_block > sb->block_count)
-                    goto no_data_block;
                 free(buf);
-                return i + offset + sb->first_data_block;
+                return i + gp->first_block;
             }
         }
     }
-no_data_block:
     free(buf);
     return 0;
 }
@@ -458,26 +577,23 @@ no_data_block:
 uint32_t first_free_inode(int fd, struct lab4fs_sb_info *sb)
 {
     uint8_t *buf;
-    uint32_t offset, block;
-    uint32_t i;
+    struct lab4fs_group *gp;
+    uint32_t g, i;
 
     buf = malloc(sb->block_size);
 
-    offset = 0;
-    for (block = sb->first_inode_bitmap_block;
-            block < sb->first_data_bitmap_block;
-            block++, offset += sb->block_size << 3) {
-        read_block(fd, sb, block, buf);
-        for (i = 0; i < sb->block_size << 3; i++) {
+    for (g = 0; g < sb->groups_count; g++) {
+        gp = &sb->groups[g];
+        if (!gp->free_inodes_count)
+            continue;
+        read_block(fd, sb, gp->inode_bitmap, buf);
+        for (i = 0; i < sb->inodes_per_group; i++) {
             if (!bit_test(buf, i)) {
-                if (i + offset >= sb->inode_count)
-                    goto no_inode;
                 free(buf);
-                return i + offset;
+                return i + g * sb->inodes_per_group;
             }
         }
     }
-no_inode:
     free(buf);
     return 0;
 }
@@ -522,6 +638,8 @@ int write_to_free_data_blocks(int fd, struct lab4fs_sb_info *sb,
             return nr_blocks - left;
         ret = write_data_blocks(fd, sb, block, 1, data + (nr_blocks - left));
         sb->free_data_block_count--;
+        sb->groups[(block - sb->first_data_block) / sb->blocks_per_group]
+            .free_blocks_count--;
         if (ret < 0)
             return nr_blocks - left;
         selected_blocks[i] = block;
@@ -545,9 +663,12 @@ int write_inode(int fd, struct lab4fs_sb_info *sb,
     read_block(fd, sb, block, buf);
     if (!bit_test(buf, offset)) {
         sb->free_inode_count--;
+        sb->groups[ino / sb->inodes_per_group].free_inodes_count--;
         bit_set(buf, offset);
         write_blocks(fd, sb, block, 1, buf);
     }
+    if (LINUX_S_ISDIR(inode->i_mode))
+        sb->groups[ino / sb->inodes_per_group].used_dirs_count++;
 
     /* which block should we write for the inode */
     locate_inode(sb, ino, &block, &offset);
@@ -574,37 +695,100 @@ int write_inode(int fd, struct lab4fs_sb_info *sb,
         write2buf32(inode->i_block[offset], buf, i);
     write2buf32(inode->i_file_acl, buf, i);
     write2buf32(inode->i_dir_acl, buf, i);
+    write2buf32(inode->i_flags, buf, i);
+    write2buf32(inode->i_dind_block, buf, i);
+    write2buf32(inode->i_tind_block, buf, i);
     write_blocks(fd, sb, block, 1, buf);
     free(buf);
 }
 
-#define MIN(x, y)   ((x) < (y) ? (x) : (y))
+/*
+ * Write an indirect block of the given level (1 for single, 2 for
+ * double, 3 for triple) mapping the first of the nr blocks, and store
+ * where it went in *where.  Every indirect block written is counted in
+ * *nr_meta.  Return how many of the blocks it maps.
+ */
+static uint32_t write_indirect_block(int fd, struct lab4fs_sb_info *sb,
+        int level, uint32_t *blocks, uint32_t nr, uint32_t *where,
+        uint32_t *nr_meta)
+{
+    uint32_t ptrs = sb->block_size >> 2;
+    uint32_t *buf;
+    uint32_t i, done = 0, child;
+
+    buf = (uint32_t *)malloc(sb->block_size);
+    memset(buf, 0, sb->block_size);
+    for (i = 0; i < ptrs && done < nr; i++) {
+        if (level == 1) {
+            buf[i] = htole32(blocks[done]);
+            done++;
+        } else {
+            done += write_indirect_block(fd, sb, level - 1, blocks + done,
+                    nr - done, &child, nr_meta);
+            buf[i] = htole32(child);
+        }
+    }
+    write_to_free_data_blocks(fd, sb, 1, buf, where);
+    (*nr_meta)++;
+    free(buf);
+    return done;
+}
 
 int write_inode_block_table(int fd, struct lab4fs_sb_info *sb,
         struct lab4fs_inode *inode, uint32_t *selected_blocks, uint32_t nr_blocks)
 {
-    uint32_t i;
-    uint32_t *buf;
+    uint32_t i, done, block, nr_meta = 0;
+    uint32_t *top[3];
+
+    top[0] = &inode->i_block[LAB4FS_IND_BLOCK];
+    top[1] = &inode->i_dind_block;
+    top[2] = &inode->i_tind_block;
 
     memset(inode->i_block, 0, 4 * LAB4FS_N_BLOCKS);
+    inode->i_dind_block = inode->i_tind_block = 0;
     for (i = 0; i < MIN(nr_blocks, LAB4FS_NDIR_BLOCKS); i++)
         inode->i_block[i] = htole32(selected_blocks[i]);
 
-    if (nr_blocks > LAB4FS_NDIR_BLOCKS) {
-        buf = (uint32_t *)malloc(sb->block_size);
-        memset(buf, 0, sb->block_size);
-        nr_blocks -= LAB4FS_NDIR_BLOCKS;
-        selected_blocks = &selected_blocks[LAB4FS_NDIR_BLOCKS];
-        for (i = 0; i < MIN(nr_blocks, sb->block_size >> 2); i++)
-            buf[i] = htole32(selected_blocks[i]);
-        write_to_free_data_blocks(fd, sb, 1, buf, &i);
-        inode->i_block[LAB4FS_IND_BLOCKS] = i;
-        free(buf);
+    done = i;
+    for (i = 0; i < 3 && done < nr_blocks; i++) {
+        done += write_indirect_block(fd, sb, i + 1, selected_blocks + done,
+                nr_blocks - done, &block, &nr_meta);
+        *top[i] = htole32(block);
+    }
+    if (done < nr_blocks) {
+        fprintf(stderr, "too many blocks for one inode: %u\n", nr_blocks);
+        return -1;
     }
-    inode->i_blocks += nr_blocks;
+    inode->i_blocks += nr_blocks + nr_meta;
     return 0;
 }
 
+/* The name hash of the kernel, lab4fs_dirhash in hash.c */
+uint32_t dirhash(const char *name, int len)
+{
+    uint32_t hash = 2166136261U;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/* Dirent v2 keeps the top bits of the name hash in file_type */
+void set_entry_tag(struct lab4fs_sb_info *sb, struct lab4fs_dir_entry *entry)
+{
+    if (!(sb->feature_incompat & LAB4FS_FEATURE_INCOMPAT_DIRHASH))
+        return;
+    entry->file_type = (entry->file_type & LAB4FS_FT_MASK) |
+        ((dirhash(entry->name, entry->name_len) >> 24) & LAB4FS_DE_TAG_MASK);
+}
+
 int write_root_dir(int fd, struct lab4fs_sb_info *sb)
 {
     uint32_t block, offset;
@@ -631,6 +815,7 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     entry->name_len = 1;
     entry->name[0] = '.';
     entry->file_type = LAB4FS_FT_DIR;
+    set_entry_tag(sb, entry);
     inode.i_size = entry->rec_len;
 
     entry = (struct lab4fs_dir_entry *)(buf + entry->rec_len);
@@ -640,6 +825,7 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     entry->name[0] = '.';
     entry->name[1] = '.';
     entry->file_type = LAB4FS_FT_DIR;
+    set_entry_tag(sb, entry);
     inode.i_size += entry->rec_len;
 
     entry = (struct lab4fs_dir_entry *)((uint8_t *)entry + entry->rec_len);
@@ -648,6 +834,7 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     entry->name_len = 1;
     entry->name[0] = 'd';
     entry->file_type = LAB4FS_FT_DIR;
+    set_entry_tag(sb, entry);
     inode.i_size += entry->rec_len;
 
     inode.i_mode = LINUX_S_IFDIR | 0755;
@@ -663,6 +850,8 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     inode.i_dtime = 0;
     inode.i_links_count = 3;
     inode.i_blocks = 0;
+    inode.i_flags = (sb->feature_incompat & LAB4FS_FEATURE_INCOMPAT_DIRHASH) ?
+        LAB4FS_DIRHASH_FL : 0;
     inode.i_dir_acl = 0755;
     inode.i_file_acl = 0755;
 
@@ -679,6 +868,7 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     entry->name_len = 1;
     entry->name[0] = '.';
     entry->file_type = LAB4FS_FT_DIR;
+    set_entry_tag(sb, entry);
     inode.i_size = entry->rec_len;
 
     entry = (struct lab4fs_dir_entry *)(buf + entry->rec_len);
@@ -688,12 +878,15 @@ int write_root_dir(int fd, struct lab4fs_sb_info *sb)
     entry->name[0] = '.';
     entry->name[1] = '.';
     entry->file_type = LAB4FS_FT_DIR;
+    set_entry_tag(sb, entry);
     inode.i_size += entry->rec_len;
 
     inode.i_atime = inode.i_ctime = inode.i_mtime = time(NULL);
     inode.i_dtime = 0;
     inode.i_links_count = 3;
     inode.i_blocks = 0;
+    inode.i_flags = (sb->feature_incompat & LAB4FS_FEATURE_INCOMPAT_DIRHASH) ?
+        LAB4FS_DIRHASH_FL : 0;
     inode.i_dir_acl = 0755;
     inode.i_file_acl = 0755;
 
@@ -711,14 +904,20 @@ int main(int argc, char *argv[])
     char *filename;
     unsigned long nr_blks, blk_size;
     struct lab4fs_sb_info *sb;
-    int fd;
+    int fd, i, hashed = 0;
 
-    if (argc < 2) {
-        fprintf(stderr, "%s filename\n", argv[0]);
+    /* -H: directories in dirent v2, with the name hash in each entry */
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-H"))
+            break;
+        hashed = 1;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "%s [-H] filename\n", argv[0]);
         return -1;
     }
 
-    filename = argv[1];
+    filename = argv[i];
     if (total_space(filename, &nr_blks, &blk_size) < 0) {
         fprintf(stderr, "%s is not a regular file nor a block device\n", filename);
         return -1;
@@ -731,11 +930,19 @@ int main(int argc, char *argv[])
     }
 
     sb = get_sb(nr_blks, blk_size);
+    if (!sb) {
+        fprintf(stderr, "%s is too small\n", filename);
+        return -1;
+    }
+    if (hashed)
+        sb->feature_incompat |= LAB4FS_FEATURE_INCOMPAT_DIRHASH;
 
     write_data_bitmap(fd, sb);
     write_inode_bitmap(fd, sb);
+    write_inode_tables(fd, sb);
 
     write_root_dir(fd, sb);
+    write_group_descs(fd, sb);
     write_super_block(fd, sb);
     return 0;
 }
@@ -0,0 +1,314 @@
+/*
+ * linux/fs/lab4fs/namecache.c
+ *
+ * In-memory name hash of linear directories.  The first lookup in a
+ * directory of a few pages or more scans it whole and notes where the
+ * record of every name is, by name hash; later lookups only read the
+ * pages their hash points to, and none at all for a missing name.
+ * lab4fs_insert_entry and lab4fs_delete_entry keep the hash current.
+ *
+ * A cache is used and changed under the directory's i_sem.  Caches are
+ * on an LRU list, and when memory is short or there are too many names
+ * cached the oldest ones whose directory is not busy are freed.
+ */
+
+#include "lab4fs.h"
+
+#define NC_MIN_PAGES    2       /* smaller directories are scanned */
+#define NC_MAX_PAGES    1024    /* bigger ones are not cached */
+#define NC_MIN_BUCKETS  16
+#define NC_MAX_BUCKETS  8192
+#define NC_MAX_TOTAL    (1 << 20)   /* names cached in all directories */
+
+struct nc_entry {
+    struct nc_entry *next;
+    __u32 hash;
+    __u32 pos;          /* of the record in the directory */
+};
+
+struct lab4fs_name_cache {
+    struct list_head lru;
+    struct inode *dir;
+    unsigned count;
+    unsigned mask;
+    struct nc_entry *buckets[0];
+};
+
+static kmem_cache_t *nc_entry_cachep;
+static struct shrinker *nc_shrinker;
+/* protects nc_lru and, with i_sem, i_name_cache of every directory */
+static spinlock_t nc_lock = SPIN_LOCK_UNLOCKED;
+static LIST_HEAD(nc_lru);       /* least recently used first */
+static atomic_t nc_nr_entries = ATOMIC_INIT(0);
+
+static inline unsigned long nc_dir_pages(struct inode *dir)
+{
+    return (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+}
+
+static int nc_insert(struct lab4fs_name_cache *nc, __u32 hash, __u32 pos)
+{
+    struct nc_entry *e = kmem_cache_alloc(nc_entry_cachep, SLAB_KERNEL);
+
+    if (!e)
+        return -ENOMEM;
+    e->hash = hash;
+    e->pos = pos;
+    e->next = nc->buckets[hash & nc->mask];
+    nc->buckets[hash & nc->mask] = e;
+    nc->count++;
+    atomic_inc(&nc_nr_entries);
+    return 0;
+}
+
+static void nc_free(struct lab4fs_name_cache *nc)
+{
+    struct nc_entry *e;
+    unsigned i;
+
+    for (i = 0; i <= nc->mask; i++) {
+        while ((e = nc->buckets[i]) != NULL) {
+            nc->buckets[i] = e->next;
+            kmem_cache_free(nc_entry_cachep, e);
+        }
+    }
+    atomic_sub(nc->count, &nc_nr_entries);
+    kfree(nc);
+}
+
+/* Free caches from the oldest on until about nr names are gone */
+static void nc_prune(int nr)
+{
+    struct lab4fs_name_cache *nc, *next;
+    LIST_HEAD(dispose);
+
+    spin_lock(&nc_lock);
+    list_for_each_entry_safe(nc, next, &nc_lru, lru) {
+        if (nr <= 0)
+            break;
+        /* Holding i_sem, the owner may be using the cache */
+        if (down_trylock(&nc->dir->i_sem))
+            continue;
+        LAB4FS_I(nc->dir)->i_name_cache = NULL;
+        up(&nc->dir->i_sem);
+        list_move(&nc->lru, &dispose);
+        nr -= nc->count;
+    }
+    spin_unlock(&nc_lock);
+
+    while (!list_empty(&dispose)) {
+        nc = list_entry(dispose.next, struct lab4fs_name_cache, lru);
+        list_del(&nc->lru);
+        nc_free(nc);
+    }
+}
+
+static int nc_shrink(int nr_to_scan, unsigned int gfp_mask)
+{
+    if (nr_to_scan) {
+        if (!(gfp_mask & __GFP_FS))
+            return -1;
+        nc_prune(nr_to_scan);
+    }
+    return atomic_read(&nc_nr_entries);
+}
+
+/* Hash every name of dir, which must not have a cache yet */
+static int nc_build(struct inode *dir)
+{
+    struct lab4fs_name_cache *nc;
+    unsigned long npages = nc_dir_pages(dir), n, ra = 0;
+    unsigned nbuckets, want;
+    int err = 0;
+
+    /* About two names per bucket, for records of 16 bytes on average */
+    want = dir->i_size / (2 * LAB4FS_DIR_REC_LEN(8));
+    for (nbuckets = NC_MIN_BUCKETS; nbuckets < want &&
+            nbuckets < NC_MAX_BUCKETS; nbuckets <<= 1)
+        ;
+    nc = kmalloc(sizeof(*nc) + nbuckets * sizeof(nc->buckets[0]),
+            GFP_KERNEL);
+    if (!nc)
+        return -ENOMEM;
+    memset(nc, 0, sizeof(*nc) + nbuckets * sizeof(nc->buckets[0]));
+    nc->dir = dir;
+    nc->mask = nbuckets - 1;
+
+    for (n = 0; n < npages && !err; n++) {
+        struct page *page;
+        struct lab4fs_dir_entry *de;
+        char *kaddr, *limit;
+        unsigned size;
+
+        ra = lab4fs_dir_readahead(dir, n, ra);
+        page = lab4fs_get_page(dir, n);
+        if (IS_ERR(page)) {
+            err = PTR_ERR(page);
+            break;
+        }
+        kaddr = page_address(page);
+        size = dir->i_size - (n << PAGE_CACHE_SHIFT);
+        if (size > PAGE_CACHE_SIZE)
+            size = PAGE_CACHE_SIZE;
+        limit = kaddr + size - LAB4FS_DIR_REC_LEN(1);
+        for (de = (struct lab4fs_dir_entry *)kaddr; (char *)de <= limit;
+                de = lab4fs_next_entry(de)) {
+            if (de->rec_len == 0) {
+                LAB4ERROR("zero-length dir entry\n");
+                err = -EIO;
+                break;
+            }
+            if (!de->inode || lab4fs_is_dot(de->name, de->name_len))
+                continue;
+            err = nc_insert(nc, lab4fs_dirhash(de->name, de->name_len),
+                    (n << PAGE_CACHE_SHIFT) + ((char *)de - kaddr));
+            if (err)
+                break;
+        }
+        lab4fs_put_page(page);
+    }
+    if (err) {
+        nc_free(nc);
+        return err;
+    }
+
+    LAB4FS_I(dir)->i_name_cache = nc;
+    spin_lock(&nc_lock);
+    list_add_tail(&nc->lru, &nc_lru);
+    spin_unlock(&nc_lock);
+    if (atomic_read(&nc_nr_entries) > NC_MAX_TOTAL)
+        nc_prune(atomic_read(&nc_nr_entries) - NC_MAX_TOTAL);
+    return 0;
+}
+
+/*
+ * Look name up in the cache of dir, building it first if need be.
+ * Return 0 if the cache knows the answer, with the entry and its page
+ * as lab4fs_find_entry gives them, or NULL in *res_dir if there is no
+ * such name; otherwise an error, and the directory must be scanned.
+ */
+int lab4fs_name_cache_find(struct inode *dir, const char *name, int namelen,
+        struct lab4fs_dir_entry **res_dir, struct page **res_page)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    struct lab4fs_name_cache *nc = ei->i_name_cache;
+    __u32 hash = lab4fs_dirhash(name, namelen);
+    struct lab4fs_dir_entry *de;
+    struct page *page;
+    struct nc_entry *e;
+    int err;
+
+    if (!nc) {
+        if (nc_dir_pages(dir) < NC_MIN_PAGES ||
+                nc_dir_pages(dir) > NC_MAX_PAGES)
+            return -ENOENT;
+        err = nc_build(dir);
+        if (err)
+            return err;
+        nc = ei->i_name_cache;
+    }
+    spin_lock(&nc_lock);
+    list_move_tail(&nc->lru, &nc_lru);
+    spin_unlock(&nc_lock);
+
+    *res_dir = NULL;
+    *res_page = NULL;
+    for (e = nc->buckets[hash & nc->mask]; e; e = e->next) {
+        if (e->hash != hash)
+            continue;
+        if (e->pos + LAB4FS_DIR_REC_LEN(1) > dir->i_size)
+            goto stale;
+        page = lab4fs_get_page(dir, e->pos >> PAGE_CACHE_SHIFT);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        de = (struct lab4fs_dir_entry *)
+            ((char *)page_address(page) + (e->pos & ~PAGE_CACHE_MASK));
+        if (lab4fs_match(namelen, name, de)) {
+            ei->i_dir_start_lookup = page->index;
+            *res_dir = de;
+            *res_page = page;
+            return 0;
+        }
+        /* Another name of the same hash, unless the cache is wrong */
+        err = !de->inode || lab4fs_dirhash(de->name, de->name_len) != hash;
+        lab4fs_put_page(page);
+        if (err)
+            goto stale;
+    }
+    return 0;
+
+stale:
+    LAB4ERROR("stale name cache of directory #%lu\n", dir->i_ino);
+    lab4fs_name_cache_drop(dir);
+    return -EIO;
+}
+
+/* The record at pos of dir now holds name */
+void lab4fs_name_cache_add(struct inode *dir, const char *name, int namelen,
+        __u32 pos)
+{
+    struct lab4fs_name_cache *nc = LAB4FS_I(dir)->i_name_cache;
+
+    if (!nc)
+        return;
+    if (nc_dir_pages(dir) > NC_MAX_PAGES ||
+            nc_insert(nc, lab4fs_dirhash(name, namelen), pos))
+        lab4fs_name_cache_drop(dir);
+}
+
+/* The record at pos of dir, which held name, is gone */
+void lab4fs_name_cache_remove(struct inode *dir, const char *name,
+        int namelen, __u32 pos)
+{
+    struct lab4fs_name_cache *nc = LAB4FS_I(dir)->i_name_cache;
+    struct nc_entry **p, *e;
+    __u32 hash;
+
+    if (!nc)
+        return;
+    hash = lab4fs_dirhash(name, namelen);
+    for (p = &nc->buckets[hash & nc->mask]; (e = *p) != NULL; p = &e->next) {
+        if (e->pos == pos) {
+            *p = e->next;
+            kmem_cache_free(nc_entry_cachep, e);
+            nc->count--;
+            atomic_dec(&nc_nr_entries);
+            return;
+        }
+    }
+}
+
+/* Forget the cache of dir, if any; records are about to move */
+void lab4fs_name_cache_drop(struct inode *dir)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(dir);
+    struct lab4fs_name_cache *nc;
+
+    spin_lock(&nc_lock);
+    nc = ei->i_name_cache;
+    if (nc) {
+        ei->i_name_cache = NULL;
+        list_del(&nc->lru);
+    }
+    spin_unlock(&nc_lock);
+    if (nc)
+        nc_free(nc);
+}
+
+int __init lab4fs_name_cache_init(void)
+{
+    nc_entry_cachep = kmem_cache_create("lab4fs_name_cache",
+            sizeof(struct nc_entry), 0, SLAB_RECLAIM_ACCOUNT, NULL, NULL);
+    if (!nc_entry_cachep)
+        return -ENOMEM;
+    nc_shrinker = set_shrinker(DEFAULT_SEEKS, nc_shrink);
+    return 0;
+}
+
+void lab4fs_name_cache_exit(void)
+{
+    if (nc_shrinker)
+        remove_shrinker(nc_shrinker);
+    if (kmem_cache_destroy(nc_entry_cachep))
+        printk(KERN_INFO "lab4fs_name_cache: not all structures were freed\n");
+}
@@ -14,14 +14,15 @@ static void print_super(struct lab4fs_super_block *sb)
 #define print_super(sb)
 #endif
 
-static void lab4fs_put_super(struct super_block *sb)
+static void lab4fs_put_groups(struct lab4fs_sb_info *sbi)
 {
-    struct lab4fs_sb_info *sbi;
-    sbi = LAB4FS_SB(sb);
-    if (sbi == NULL)
+    int i;
+    if (sbi->s_group_desc == NULL)
         return;
-    kfree(sbi);
-    return;
+    for (i = 0; i < sbi->s_gdb_count; i++)
+        brelse(sbi->s_group_desc[i]);
+    kfree(sbi->s_group_desc);
+    sbi->s_group_desc = NULL;
 }
 
 static kmem_cache_t *lab4fs_inode_cachep;
@@ -34,34 +35,130 @@ static struct inode *lab4fs_alloc_inode(struct super_block *sb)
 		return NULL;
     ei->vfs_inode.i_sb = sb;
     ei->i_dir_start_lookup = 0;
+    ei->i_name_cache = NULL;
+    ei->i_dir_live = LAB4FS_DIR_LIVE_UNKNOWN;
+    atomic_set(&ei->i_dir_opens, 0);
+    ei->i_dir_compact = 0;
+    ei->i_dir_free = NULL;
+    init_rwsem(&ei->i_ext_sem);
+    ei->i_next_alloc_block = 0;
+    ei->i_next_alloc_goal = 0;
+    ei->i_rsv_window.rsv_start = LAB4FS_RSV_NONE;
+    ei->i_rsv_window.rsv_end = LAB4FS_RSV_NONE;
+    ei->i_rsv_window.rsv_goal_size = LAB4FS_DEFAULT_RSV_BLOCKS;
+    ei->i_prealloc_block = 0;
+    ei->i_prealloc_count = 0;
+    ei->i_prealloc_delayed = 0;
+    ei->i_delayed_blocks = 0;
+    ei->i_delayed_meta = 0;
+    ei->i_delayed_meta_leaf = 0;
+    ei->i_map_len = 0;
+    ei->i_map_gen = 0;
     rwlock_init(&ei->rwlock);
 	return &ei->vfs_inode;
 }
 
+static void lab4fs_clear_inode(struct inode *inode)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+
+    /* The pages are gone by now; this only catches leaked reservations */
+    if (ei->i_delayed_blocks || ei->i_delayed_meta)
+        lab4fs_release_delayed(inode, ei->i_delayed_blocks,
+                ei->i_delayed_meta);
+    lab4fs_discard_prealloc(inode);
+    lab4fs_discard_reservation(inode);
+    lab4fs_name_cache_drop(inode);
+    lab4fs_free_map_drop(inode);
+}
+
 static void lab4fs_destroy_inode(struct inode *inode)
 {
     LAB4DEBUG("destroy inode %u\n", (unsigned)inode->i_ino);
 	kmem_cache_free(lab4fs_inode_cachep, LAB4FS_I(inode));
 }
 
+/*
+ * The free counts of the groups are kept by the bitmaps in memory, and
+ * only copied into the descriptors when the superblock is written.
+ */
+static void lab4fs_sync_groups(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_group_desc *gdp;
+    struct buffer_head *bh;
+    int i;
+
+    if (sbi->s_group_desc == NULL)
+        return;
+    for (i = 0; i < sbi->s_groups_count; i++) {
+        gdp = lab4fs_get_group_desc(sb, i, &bh);
+        gdp->bg_free_blocks_count =
+            cpu_to_le16(sbi->s_data_bitmap.blocks[i].nr_free);
+        gdp->bg_free_inodes_count =
+            cpu_to_le16(sbi->s_inode_bitmap.blocks[i].nr_free);
+        mark_buffer_dirty(bh);
+    }
+}
+
 void lab4fs_write_super (struct super_block * sb)
 {
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
     struct lab4fs_super_block *es;
+    long free;
     lock_kernel();
-    es = LAB4FS_SB(sb)->s_sb;
+    es = sbi->s_sb;
+    lab4fs_sync_groups(sb);
+    free = percpu_counter_sum(&sbi->s_free_inodes_counter);
+    es->s_free_inodes_count = cpu_to_le32(free > 0 ? free : 0);
+    free = percpu_counter_sum(&sbi->s_free_data_blocks_counter);
+    es->s_free_data_blocks_count = cpu_to_le32(free > 0 ? free : 0);
     mark_buffer_dirty(LAB4FS_SB(sb)->s_sbh);
     sb->s_dirt = 0;
     unlock_kernel();
 }
 
+static void lab4fs_put_super(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi;
+    sbi = LAB4FS_SB(sb);
+    if (sbi == NULL)
+        return;
+    /*
+     * The numbers still in batches go back to the bitmap, so the free
+     * counts have to be written out again after the last write_super.
+     */
+    lab4fs_destroy_ino_batches(sb);
+    if (!(sb->s_flags & MS_RDONLY)) {
+        lab4fs_write_super(sb);
+        sync_dirty_buffer(sbi->s_sbh);
+    }
+    bitmap_destroy(&sbi->s_inode_bitmap);
+    bitmap_destroy(&sbi->s_data_bitmap);
+    lab4fs_put_groups(sbi);
+    percpu_counter_destroy(&sbi->s_free_inodes_counter);
+    percpu_counter_destroy(&sbi->s_free_data_blocks_counter);
+    percpu_counter_destroy(&sbi->s_delayed_blocks_counter);
+    kfree(sbi);
+    return;
+}
+
 static 
 int lab4fs_statfs(struct super_block *sb, struct kstatfs *buf)
 {
     struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    long free;
     buf->f_type = sb->s_magic;
-	buf->f_bsize = 1024;
+	buf->f_bsize = sb->s_blocksize;
 	buf->f_namelen = 255;
-    buf->f_bfree = sbi->s_free_data_blocks_count;
+    buf->f_blocks = sbi->s_blocks_count - sbi->s_data_blocks;
+    free = percpu_counter_sum(&sbi->s_free_data_blocks_counter) -
+        percpu_counter_sum(&sbi->s_delayed_blocks_counter);
+    buf->f_bfree = free > 0 ? free : 0;
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sbi->s_inodes_count;
+    free = percpu_counter_sum(&sbi->s_free_inodes_counter);
+    buf->f_ffree = free > 0 ? free : 0;
     return 0;
 }
 
@@ -69,6 +166,7 @@ struct super_operations lab4fs_super_ops = {
     .alloc_inode    = lab4fs_alloc_inode,
 	.delete_inode   = lab4fs_delete_inode,
     .destroy_inode  = lab4fs_destroy_inode,
+    .clear_inode    = lab4fs_clear_inode,
     .read_inode     = lab4fs_read_inode,
     .write_inode    = lab4fs_write_inode,
     .statfs         = lab4fs_statfs,
@@ -110,6 +208,182 @@ struct inode *lab4fs_get_inode(struct super_block *sb, int mode, dev_t dev)
 }
 */
 
+/* Where bitmap block n is, and what the group descriptor says of it */
+static __u32 lab4fs_inode_bitmap_block(struct super_block *sb, int n,
+        int *nr_free)
+{
+    struct lab4fs_group_desc *gdp;
+
+    if (!LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_GROUPS)) {
+        *nr_free = -1;
+        return le32_to_cpu(LAB4FS_SB(sb)->s_sb->s_inode_bitmap) + n;
+    }
+    gdp = lab4fs_get_group_desc(sb, n, NULL);
+    *nr_free = le16_to_cpu(gdp->bg_free_inodes_count);
+    return le32_to_cpu(gdp->bg_inode_bitmap);
+}
+
+static __u32 lab4fs_data_bitmap_block(struct super_block *sb, int n,
+        int *nr_free)
+{
+    struct lab4fs_group_desc *gdp;
+
+    if (!LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_GROUPS)) {
+        *nr_free = -1;
+        return le32_to_cpu(LAB4FS_SB(sb)->s_sb->s_data_bitmap) + n;
+    }
+    gdp = lab4fs_get_group_desc(sb, n, NULL);
+    *nr_free = le16_to_cpu(gdp->bg_free_blocks_count);
+    return le32_to_cpu(gdp->bg_block_bitmap);
+}
+
+/*
+ * Work out the group geometry and read the group descriptors.  The flat
+ * layout is handled as a single group spanning the whole fs.
+ */
+static int lab4fs_load_groups(struct super_block *sb)
+{
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_super_block *es = sbi->s_sb;
+    __u32 bpg, ipg, first;
+    int i;
+
+    sbi->s_inodes_per_block = sb->s_blocksize / sbi->s_inode_size;
+    if (!LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_GROUPS)) {
+        sbi->s_groups_count = 1;
+        sbi->s_blocks_per_group = sbi->s_blocks_count - sbi->s_data_blocks;
+        sbi->s_inodes_per_group = sbi->s_inodes_count;
+        return 0;
+    }
+
+    bpg = le32_to_cpu(es->s_blocks_per_group);
+    ipg = le32_to_cpu(es->s_inodes_per_group);
+    if (!bpg || (bpg & (bpg - 1)) || bpg > sb->s_blocksize << 3 ||
+            !ipg || (ipg & (ipg - 1)) || ipg > sb->s_blocksize << 3 ||
+            ipg % sbi->s_inodes_per_block) {
+        LAB4ERROR("bad group geometry: %u blocks, %u inodes per group\n",
+                bpg, ipg);
+        return -EINVAL;
+    }
+    sbi->s_blocks_per_group = bpg;
+    sbi->s_inodes_per_group = ipg;
+    sbi->s_groups_count = (sbi->s_blocks_count - sbi->s_data_blocks +
+            bpg - 1) / bpg;
+    if (sbi->s_inodes_count != sbi->s_groups_count * ipg) {
+        LAB4ERROR("%u inodes do not fit %lu groups of %u\n",
+                sbi->s_inodes_count, sbi->s_groups_count, ipg);
+        return -EINVAL;
+    }
+
+    sbi->s_desc_per_block = LAB4FS_DESC_PER_BLOCK(sb);
+    sbi->s_gdb_count = (sbi->s_groups_count + sbi->s_desc_per_block - 1) /
+        sbi->s_desc_per_block;
+    sbi->s_group_desc = kmalloc(sbi->s_gdb_count *
+            sizeof(struct buffer_head *), GFP_KERNEL);
+    if (sbi->s_group_desc == NULL)
+        return -ENOMEM;
+    first = le32_to_cpu(es->s_group_desc);
+    for (i = 0; i < sbi->s_gdb_count; i++) {
+        sbi->s_group_desc[i] = sb_bread(sb, first + i);
+        if (!sbi->s_group_desc[i]) {
+            LAB4ERROR("unable to read group descriptors\n");
+            sbi->s_gdb_count = i;
+            lab4fs_put_groups(sbi);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The largest file the block mapping can address; i_size has 64 bits
+ * for regular files, see lab4fs_read_inode.
+ */
+static loff_t lab4fs_max_size(int bits)
+{
+    loff_t res = LAB4FS_NDIR_BLOCKS;
+    int ptr_bits = bits - 2;
+
+    res += 1LL << ptr_bits;
+    res += 1LL << (2 * ptr_bits);
+    res += 1LL << (3 * ptr_bits);
+    res <<= bits;
+    if (res > MAX_LFS_FILESIZE)
+        res = MAX_LFS_FILESIZE;
+    return res;
+}
+
+enum {
+    Opt_extents, Opt_noextents, Opt_inline_data, Opt_noinline_data,
+    Opt_tail, Opt_notail, Opt_dir_index, Opt_nodir_index, Opt_name_cache,
+    Opt_noname_cache, Opt_err
+};
+
+static match_table_t tokens = {
+    {Opt_extents, "extents"},
+    {Opt_noextents, "noextents"},
+    {Opt_inline_data, "inline_data"},
+    {Opt_noinline_data, "noinline_data"},
+    {Opt_tail, "tail"},
+    {Opt_notail, "notail"},
+    {Opt_dir_index, "dir_index"},
+    {Opt_nodir_index, "nodir_index"},
+    {Opt_name_cache, "name_cache"},
+    {Opt_noname_cache, "noname_cache"},
+    {Opt_err, NULL}
+};
+
+static int parse_options(char *options, struct lab4fs_sb_info *sbi)
+{
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+    int token;
+
+    if (!options)
+        return 1;
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        token = match_token(p, tokens, args);
+        switch (token) {
+        case Opt_extents:
+            set_opt(sbi->s_mount_opt, EXTENTS);
+            break;
+        case Opt_noextents:
+            clear_opt(sbi->s_mount_opt, EXTENTS);
+            break;
+        case Opt_inline_data:
+            set_opt(sbi->s_mount_opt, INLINE_DATA);
+            break;
+        case Opt_noinline_data:
+            clear_opt(sbi->s_mount_opt, INLINE_DATA);
+            break;
+        case Opt_tail:
+            set_opt(sbi->s_mount_opt, TAIL);
+            break;
+        case Opt_notail:
+            clear_opt(sbi->s_mount_opt, TAIL);
+            break;
+        case Opt_dir_index:
+            set_opt(sbi->s_mount_opt, DIR_INDEX);
+            break;
+        case Opt_nodir_index:
+            clear_opt(sbi->s_mount_opt, DIR_INDEX);
+            break;
+        case Opt_name_cache:
+            set_opt(sbi->s_mount_opt, NAME_CACHE);
+            break;
+        case Opt_noname_cache:
+            clear_opt(sbi->s_mount_opt, NAME_CACHE);
+            break;
+        default:
+            LAB4ERROR("unrecognized mount option \"%s\"\n", p);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static int lab4fs_fill_super(struct super_block * sb, void * data, int silent)
 {
     struct buffer_head * bh;
@@ -191,7 +465,49 @@ static int lab4fs_fill_super(struct super_block * sb, void * data, int silent)
             goto failed_mount;
         }
     }
-    sb->s_maxbytes = lab4fs_max_size(es);
+    if (es->s_feature_incompat &
+            cpu_to_le32(~LAB4FS_FEATURE_INCOMPAT_SUPP)) {
+        LAB4ERROR("%s: unsupported features %x\n", sb->s_id,
+                le32_to_cpu(es->s_feature_incompat));
+        err = -EINVAL;
+        goto failed_mount;
+    }
+    if (le32_to_cpu(es->s_inode_size) < sizeof(struct lab4fs_inode)) {
+        LAB4ERROR("%s: inode size %u too small\n", sb->s_id,
+                le32_to_cpu(es->s_inode_size));
+        err = -EINVAL;
+        goto failed_mount;
+    }
+    if (!parse_options(data, sbi)) {
+        err = -EINVAL;
+        goto failed_mount;
+    }
+    if (test_opt(sb, EXTENTS) &&
+            !LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_EXTENTS)) {
+        es->s_feature_incompat |=
+            cpu_to_le32(LAB4FS_FEATURE_INCOMPAT_EXTENTS);
+        mark_buffer_dirty(bh);
+    }
+    if (test_opt(sb, INLINE_DATA) &&
+            !LAB4FS_HAS_INCOMPAT_FEATURE(sb,
+                LAB4FS_FEATURE_INCOMPAT_INLINE_DATA)) {
+        es->s_feature_incompat |=
+            cpu_to_le32(LAB4FS_FEATURE_INCOMPAT_INLINE_DATA);
+        mark_buffer_dirty(bh);
+    }
+    if (test_opt(sb, TAIL) &&
+            !LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_TAIL)) {
+        es->s_feature_incompat |= cpu_to_le32(LAB4FS_FEATURE_INCOMPAT_TAIL);
+        mark_buffer_dirty(bh);
+    }
+    if (test_opt(sb, DIR_INDEX) &&
+            !LAB4FS_HAS_INCOMPAT_FEATURE(sb,
+                LAB4FS_FEATURE_INCOMPAT_DIR_INDEX)) {
+        es->s_feature_incompat |=
+            cpu_to_le32(LAB4FS_FEATURE_INCOMPAT_DIR_INDEX);
+        mark_buffer_dirty(bh);
+    }
+    sb->s_maxbytes = lab4fs_max_size(log2(sb->s_blocksize));
     sbi->s_sbh = bh;
     sbi->s_log_block_size = log2(sb->s_blocksize);
     sbi->s_first_ino = le32_to_cpu(es->s_first_inode);
@@ -199,9 +515,12 @@ static int lab4fs_fill_super(struct super_block * sb, void * data, int silent)
     sbi->s_log_inode_size = log2(sbi->s_inode_size);
     sbi->s_inode_table = le32_to_cpu(es->s_inode_table);
     sbi->s_data_blocks = le32_to_cpu(es->s_data_blocks);
-    sbi->s_next_generation = 0;
-    sbi->s_free_inodes_count = le32_to_cpu(es->s_free_inodes_count);
-    sbi->s_free_data_blocks_count = le32_to_cpu(es->s_free_data_blocks_count);
+    atomic_set(&sbi->s_next_generation, 0);
+    percpu_counter_init(&sbi->s_free_inodes_counter,
+            le32_to_cpu(es->s_free_inodes_count));
+    percpu_counter_init(&sbi->s_free_data_blocks_counter,
+            le32_to_cpu(es->s_free_data_blocks_count));
+    percpu_counter_init(&sbi->s_delayed_blocks_counter, 0);
     sbi->s_inodes_count = le32_to_cpu(es->s_inodes_count);
     sbi->s_blocks_count = le32_to_cpu(es->s_blocks_count);
 
@@ -210,14 +529,37 @@ static int lab4fs_fill_super(struct super_block * sb, void * data, int silent)
         - le32_to_cpu(es->s_data_blocks);
 
     rwlock_init(&sbi->rwlock);
+    spin_lock_init(&sbi->s_group_lock);
+    spin_lock_init(&sbi->s_rsv_window_lock);
+    sbi->s_rsv_window_root = RB_ROOT;
+    init_MUTEX(&sbi->s_frag_sem);
+    sbi->s_frag_block = 0;
     sb->s_op = &lab4fs_super_ops;
 
-    err = bitmap_setup(&sbi->s_inode_bitmap, sb, le32_to_cpu(es->s_inode_bitmap));
+    err = lab4fs_load_groups(sb);
     if (err)
-        goto out_fail;
-    err = bitmap_setup(&sbi->s_data_bitmap, sb, le32_to_cpu(es->s_data_bitmap));
+        goto failed_counters;
+
+    if (LAB4FS_HAS_INCOMPAT_FEATURE(sb, LAB4FS_FEATURE_INCOMPAT_GROUPS)) {
+        err = bitmap_setup(&sbi->s_inode_bitmap, sb,
+                sbi->s_inodes_per_group, lab4fs_inode_bitmap_block);
+        if (err)
+            goto failed_groups;
+        err = bitmap_setup(&sbi->s_data_bitmap, sb,
+                sbi->s_blocks_per_group, lab4fs_data_bitmap_block);
+    } else {
+        err = bitmap_setup(&sbi->s_inode_bitmap, sb, sb->s_blocksize << 3,
+                lab4fs_inode_bitmap_block);
+        if (err)
+            goto failed_groups;
+        err = bitmap_setup(&sbi->s_data_bitmap, sb, sb->s_blocksize << 3,
+                lab4fs_data_bitmap_block);
+    }
     if (err)
-        goto out_fail;
+        goto failed_inode_bitmap;
+    err = lab4fs_init_ino_batches(sb);
+    if (err)
+        goto failed_data_bitmap;
 
     sbi->s_root_inode = le32_to_cpu(es->s_root_inode);
     root = iget(sb, sbi->s_root_inode);
@@ -227,11 +569,28 @@ static int lab4fs_fill_super(struct super_block * sb, void * data, int silent)
     sb->s_root = d_alloc_root(root);
     if (!sb->s_root) {
         iput(root);
+        lab4fs_destroy_ino_batches(sb);
+        bitmap_destroy(&sbi->s_data_bitmap);
+        bitmap_destroy(&sbi->s_inode_bitmap);
+        lab4fs_put_groups(sbi);
+        percpu_counter_destroy(&sbi->s_free_inodes_counter);
+        percpu_counter_destroy(&sbi->s_free_data_blocks_counter);
+        percpu_counter_destroy(&sbi->s_delayed_blocks_counter);
         kfree(sbi);
         return -ENOMEM;
     }
     return 0;
 
+failed_data_bitmap:
+    bitmap_destroy(&sbi->s_data_bitmap);
+failed_inode_bitmap:
+    bitmap_destroy(&sbi->s_inode_bitmap);
+failed_groups:
+    lab4fs_put_groups(sbi);
+failed_counters:
+    percpu_counter_destroy(&sbi->s_free_inodes_counter);
+    percpu_counter_destroy(&sbi->s_free_data_blocks_counter);
+    percpu_counter_destroy(&sbi->s_delayed_blocks_counter);
 failed_mount:
 out_fail:
 	kfree(sbi);
@@ -269,24 +628,37 @@ static int init_inodecache(void)
 	return 0;
 }
 
+static void destroy_inodecache(void)
+{
+	if (kmem_cache_destroy(lab4fs_inode_cachep))
+		printk(KERN_INFO "lab4fs_inode_cache: not all structures were freed\n");
+}
+
 static int __init init_lab4fs_fs(void)
 {
     int err;
     err = init_inodecache();
     if (err)
         return err;
-	return register_filesystem(&lab4fs_fs_type);
-}
+    err = lab4fs_name_cache_init();
+    if (err)
+        goto out_inodecache;
+    err = register_filesystem(&lab4fs_fs_type);
+    if (err)
+        goto out_name_cache;
+    return 0;
 
-static void destroy_inodecache(void)
-{
-	if (kmem_cache_destroy(lab4fs_inode_cachep))
-		printk(KERN_INFO "lab4fs_inode_cache: not all structures were freed\n");
+out_name_cache:
+    lab4fs_name_cache_exit();
+out_inodecache:
+    destroy_inodecache();
+    return err;
 }
 
 static void __exit exit_lab4fs_fs(void)
 {
 	unregister_filesystem(&lab4fs_fs_type);
+	lab4fs_name_cache_exit();
 	destroy_inodecache();
 }
 
@@ -0,0 +1,242 @@
+/*
+ * linux/fs/lab4fs/tail.c
+ *
+ * Fragment blocks: the data of small files packed several to a block.
+ *
+ * A fragment block is cut in LAB4FS_FRAG_SIZE fragments.  The first
+ * one holds a struct lab4fs_frag_header, whose map has a bit set for
+ * every fragment in use, its own included, and the block goes back to
+ * the bitmap with the last file in it.  A file kept in fragments
+ * (LAB4FS_TAIL_FL) has the block in i_block[0], and its first fragment
+ * and the number of them in i_block[1] and i_block[2].
+ */
+
+#include "lab4fs.h"
+
+static inline __u64 frag_map(struct lab4fs_frag_header *fh)
+{
+    return le32_to_cpu(fh->fh_map[0]) |
+        ((__u64)le32_to_cpu(fh->fh_map[1]) << 32);
+}
+
+static inline void frag_set_map(struct lab4fs_frag_header *fh, __u64 map)
+{
+    fh->fh_map[0] = cpu_to_le32((__u32)map);
+    fh->fh_map[1] = cpu_to_le32((__u32)(map >> 32));
+}
+
+static inline __u64 frag_bits(int frag, int count)
+{
+    return (((__u64)1 << count) - 1) << frag;
+}
+
+/* First of count free fragments in a row in map, -1 if there are none */
+static int frag_find(__u64 map, int nr, int count)
+{
+    int i, run = 0;
+
+    for (i = 1; i < nr; i++) {
+        if (map & ((__u64)1 << i))
+            run = 0;
+        else if (++run == count)
+            return i - count + 1;
+    }
+    return -1;
+}
+
+static struct buffer_head *frag_read(struct super_block *sb, __u32 block)
+{
+    struct buffer_head *bh = sb_bread(sb, block);
+    struct lab4fs_frag_header *fh;
+
+    if (!bh) {
+        LAB4ERROR("cannot read fragment block %u\n", block);
+        return NULL;
+    }
+    fh = (struct lab4fs_frag_header *)bh->b_data;
+    if (le16_to_cpu(fh->fh_magic) != LAB4FS_FRAG_MAGIC) {
+        LAB4ERROR("block %u is not a fragment block\n", block);
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*
+ * Store the len bytes at data in free fragments, from the last fragment
+ * block known to have room or from a new one, and make them the data
+ * of inode.  The fragments after data are zeroed.
+ */
+int lab4fs_tail_alloc(struct inode *inode, const char *data, unsigned len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    struct lab4fs_frag_header *fh;
+    struct buffer_head *bh = NULL;
+    int count = (len + LAB4FS_FRAG_SIZE - 1) >> LAB4FS_FRAG_BITS;
+    int nr = LAB4FS_FRAGS_PER_BLOCK(sb);
+    unsigned long one = 1;
+    long err = 0;
+    __u32 block;
+    int frag = -1;
+
+    if (!count || count >= nr)
+        return -EINVAL;
+    down(&sbi->s_frag_sem);
+    block = sbi->s_frag_block;
+    if (block) {
+        bh = frag_read(sb, block);
+        if (bh) {
+            fh = (struct lab4fs_frag_header *)bh->b_data;
+            frag = frag_find(frag_map(fh), nr, count);
+        }
+        if (frag < 0) {
+            brelse(bh);
+            bh = NULL;
+        }
+    }
+    if (!bh) {
+        block = lab4fs_alloc_blocks(inode, lab4fs_inode_goal(inode), &one,
+                &err);
+        if (err)
+            goto out;
+        bh = sb_getblk(sb, block);
+        if (!bh) {
+            lab4fs_free_blocks(inode, block, 1);
+            err = -EIO;
+            goto out;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        fh = (struct lab4fs_frag_header *)bh->b_data;
+        fh->fh_magic = cpu_to_le16(LAB4FS_FRAG_MAGIC);
+        frag_set_map(fh, 1);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        sbi->s_frag_block = block;
+        frag = 1;
+    }
+
+    frag_set_map(fh, frag_map(fh) | frag_bits(frag, count));
+    memcpy(bh->b_data + (frag << LAB4FS_FRAG_BITS), data, len);
+    memset(bh->b_data + (frag << LAB4FS_FRAG_BITS) + len, 0,
+            (count << LAB4FS_FRAG_BITS) - len);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    write_lock(&ei->rwlock);
+    memset(ei->i_block, 0, sizeof(ei->i_block));
+    ei->i_block[0] = cpu_to_le32(block);
+    ei->i_block[1] = cpu_to_le32(frag);
+    ei->i_block[2] = cpu_to_le32(count);
+    ei->i_flags = (ei->i_flags & ~LAB4FS_EXTENTS_FL) | LAB4FS_TAIL_FL;
+    write_unlock(&ei->rwlock);
+    mark_inode_dirty(inode);
+out:
+    up(&sbi->s_frag_sem);
+    return err;
+}
+
+/*
+ * Give back fragments, described as in i_block of a tail inode.  If the
+ * block is left with none in use it is freed, otherwise it is the next
+ * one lab4fs_tail_alloc looks at when it has nothing better.
+ */
+void lab4fs_tail_free(struct inode *inode, __le32 *i_block)
+{
+    struct super_block *sb = inode->i_sb;
+    struct lab4fs_sb_info *sbi = LAB4FS_SB(sb);
+    struct lab4fs_frag_header *fh;
+    struct buffer_head *bh;
+    __u32 block = le32_to_cpu(i_block[0]);
+    int frag = le32_to_cpu(i_block[1]);
+    int count = le32_to_cpu(i_block[2]);
+    __u64 map;
+
+    if (frag < 1 || count < 1 || frag + count > LAB4FS_FRAGS_PER_BLOCK(sb)) {
+        LAB4ERROR("bad fragments %d+%d of inode %lu\n", frag, count,
+                inode->i_ino);
+        return;
+    }
+    down(&sbi->s_frag_sem);
+    bh = frag_read(sb, block);
+    if (!bh)
+        goto out;
+    fh = (struct lab4fs_frag_header *)bh->b_data;
+    map = frag_map(fh) & ~frag_bits(frag, count);
+    if (map == 1) {
+        if (sbi->s_frag_block == block)
+            sbi->s_frag_block = 0;
+        bforget(bh);
+        lab4fs_free_blocks(inode, block, 1);
+        goto out;
+    }
+    frag_set_map(fh, map);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    if (!sbi->s_frag_block)
+        sbi->s_frag_block = block;
+out:
+    up(&sbi->s_frag_sem);
+}
+
+/* How many bytes the fragments of tail inode hold */
+unsigned lab4fs_tail_room(struct inode *inode)
+{
+    return le32_to_cpu(LAB4FS_I(inode)->i_block[2]) << LAB4FS_FRAG_BITS;
+}
+
+static struct buffer_head *tail_bread(struct inode *inode, char **data)
+{
+    struct lab4fs_inode_info *ei = LAB4FS_I(inode);
+    __u32 block = le32_to_cpu(ei->i_block[0]);
+    struct buffer_head *bh = sb_bread(inode->i_sb, block);
+
+    if (!bh) {
+        LAB4ERROR("cannot read fragment block %u of inode %lu\n", block,
+                inode->i_ino);
+        return NULL;
+    }
+    *data = bh->b_data + (le32_to_cpu(ei->i_block[1]) << LAB4FS_FRAG_BITS);
+    return bh;
+}
+
+/* Copy the first len bytes of the data of tail inode to data */
+int lab4fs_tail_read(struct inode *inode, char *data, unsigned len)
+{
+    struct buffer_head *bh;
+    char *p;
+
+    bh = tail_bread(inode, &p);
+    if (!bh)
+        return -EIO;
+    memcpy(data, p, min(len, lab4fs_tail_room(inode)));
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Make the len bytes at data the data of tail inode, and zero the rest
+ * of its fragments.  With data NULL, the first len bytes are kept.
+ */
+int lab4fs_tail_write(struct inode *inode, const char *data, unsigned len)
+{
+    unsigned room = lab4fs_tail_room(inode);
+    struct buffer_head *bh;
+    char *p;
+
+    bh = tail_bread(inode, &p);
+    if (!bh)
+        return -EIO;
+    if (len > room)
+        len = room;
+    lock_buffer(bh);
+    if (data)
+        memcpy(p, data, len);
+    memset(p + len, 0, room - len);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return 0;
+}